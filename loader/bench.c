@@ -0,0 +1,126 @@
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define DUMMY_SYSCALL_NR 462
+#define BENCH_INPUT_ID 2 // not RETURN_ID, which pops the call stack
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_checks(long iterations) {
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        syscall(DUMMY_SYSCALL_NR, BENCH_INPUT_ID);
+    }
+    return (now_ns() - start) / iterations;
+}
+
+// Loads the monitor in the given mode with a single self-loop rule on the
+// start state, so every check of this process succeeds without being killed.
+static int bench_mode(enum attach_mode mode, long iterations, double baseline) {
+    struct monitor *skel;
+    int err;
+
+    skel = monitor__open();
+    if (!skel) {
+        fprintf(stderr, "ERROR: Failed to open BPF skeleton\n");
+        return -1;
+    }
+
+    select_attach_mode(skel, mode);
+
+    err = monitor__load(skel);
+    if (err) {
+        printf("%-8s unavailable (load failed: %s)\n", attach_mode_names[mode], strerror(-err));
+        goto cleanup;
+    }
+
+    int table_fd = create_policy_table();
+    if (table_fd < 0) {
+        err = table_fd;
+        goto cleanup;
+    }
+
+    struct nfa_key key = {.current_state = 0, .input_id = BENCH_INPUT_ID};
+    struct nfa_value value = {.next_state = 0, .is_final_state = 0, .push_state = NO_PUSH};
+    err = bpf_map_update_elem(table_fd, &key, &value, BPF_ANY);
+    if (err) {
+        fprintf(stderr, "ERROR: Failed to upload rule: %s\n", strerror(errno));
+        close(table_fd);
+        goto cleanup;
+    }
+
+    err = install_policy_table(skel, DEFAULT_POLICY, table_fd);
+    if (err) {
+        goto cleanup;
+    }
+
+    err = monitor__attach(skel);
+    if (err) {
+        printf("%-8s unavailable (attach failed: %s)\n", attach_mode_names[mode], strerror(-err));
+        goto cleanup;
+    }
+
+    // Warm up maps and caches before measuring
+    time_checks(iterations / 10 + 1);
+    double per_call = time_checks(iterations);
+    printf("%-8s %10.1f ns/call %10.1f ns/check\n", attach_mode_names[mode], per_call, per_call - baseline);
+
+cleanup:
+    monitor__destroy(skel);
+    return err;
+}
+
+int main(int argc, char **argv) {
+    long iterations = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [mode...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (iterations <= 0) {
+        fprintf(stderr, "ERROR: Invalid iteration count.\n");
+        return 1;
+    }
+
+    time_checks(iterations / 10 + 1);
+    double baseline = time_checks(iterations);
+    printf("%-8s %10.1f ns/call\n", "none", baseline);
+
+    if (optind == argc) {
+        for (int mode = 0; mode < ATTACH_MODE_COUNT; mode++) {
+            bench_mode(mode, iterations, baseline);
+        }
+        return 0;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        int mode = parse_attach_mode(argv[i]);
+        if (mode < 0) {
+            fprintf(stderr, "ERROR: Unknown attach mode: %s\n", argv[i]);
+            return 1;
+        }
+        bench_mode(mode, iterations, baseline);
+    }
+
+    return 0;
+}
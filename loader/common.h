@@ -0,0 +1,107 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "monitor.skel.h"
+
+#define MAX_POLICIES 64
+#define MAX_RULES 10240
+#define DEFAULT_POLICY 0
+#define NO_PUSH 0xFFFFFFFF
+
+struct nfa_key {
+    __u32 current_state;
+    __u32 input_id;
+};
+
+struct nfa_value {
+    __u32 next_state;
+    __u32 is_final_state;
+    __u32 push_state;
+};
+
+struct exe_key {
+    __u32 dev;
+    __u32 pad;
+    __u64 ino;
+};
+
+struct profile_key {
+    __u32 policy_id;
+    __u32 current_state;
+    __u32 input_id;
+};
+
+enum attach_mode {
+    ATTACH_TP,
+    ATTACH_RAW_TP,
+    ATTACH_FENTRY,
+    ATTACH_MODE_COUNT,
+};
+
+static const char *attach_mode_names[ATTACH_MODE_COUNT] = {
+    [ATTACH_TP] = "tp",
+    [ATTACH_RAW_TP] = "raw_tp",
+    [ATTACH_FENTRY] = "fentry",
+};
+
+static int parse_attach_mode(const char *name) {
+    for (int mode = 0; mode < ATTACH_MODE_COUNT; mode++) {
+        if (strcmp(name, attach_mode_names[mode]) == 0) {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+// Must be called between monitor__open() and monitor__load()
+static void select_attach_mode(struct monitor *skel, enum attach_mode mode) {
+    bpf_program__set_autoload(skel->progs.on_dummy_syscall, mode == ATTACH_TP);
+    bpf_program__set_autoload(skel->progs.on_sys_enter, mode == ATTACH_RAW_TP);
+    bpf_program__set_autoload(skel->progs.on_dummy_fentry, mode == ATTACH_FENTRY);
+    // Only monitor-replay needs the trace buffer
+    bpf_map__set_autocreate(skel->maps.replay_trace_map, false);
+}
+
+// Parses one "<state> <input> <next> <is_final> [<push>]" line of an nfa.dat file
+static bool parse_nfa_rule(const char *line, struct nfa_key *key, struct nfa_value *value) {
+    *key = (struct nfa_key){};
+    *value = (struct nfa_value){.push_state = NO_PUSH};
+    int ret = sscanf(line, "%u %u %u %u %u", &key->current_state, &key->input_id, &value->next_state,
+                     &value->is_final_state, &value->push_state);
+    return ret == 4 || ret == 5;
+}
+
+// Creates an empty transition table; type and flags must match the
+// nfa_table template the skeleton was loaded with
+static int create_policy_table_as(enum bpf_map_type type, __u32 map_flags) {
+    LIBBPF_OPTS(bpf_map_create_opts, opts, .map_flags = map_flags);
+    int fd = bpf_map_create(type, "nfa_table", sizeof(struct nfa_key), sizeof(struct nfa_value), MAX_RULES, &opts);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Failed to create transition table: %s\n", strerror(errno));
+    }
+    return fd;
+}
+
+static int create_policy_table(void) {
+    return create_policy_table_as(BPF_MAP_TYPE_HASH, 0);
+}
+
+// Publishes a filled table; the outer map keeps it alive after fd is closed
+static int install_policy_table(struct monitor *skel, __u32 policy_id, int fd) {
+    int err = bpf_map__update_elem(skel->maps.nfa_transition_map, &policy_id, sizeof(policy_id), &fd, sizeof(fd),
+                                   BPF_ANY);
+    if (err) {
+        fprintf(stderr, "ERROR: Failed to install policy %u: %s\n", policy_id, strerror(-err));
+    }
+    close(fd);
+    return err;
+}
+
+#endif
@@ -1,21 +1,22 @@
 #include <bpf/libbpf.h>
+#include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
-#include "monitor.skel.h"
+#include "common.h"
 
-struct nfa_key {
-    __u32 current_state;
-    __u32 input_id;
-};
-
-struct nfa_value {
-    __u32 next_state;
-    __u32 is_final_state;
-};
+#define PIN_DIR "/sys/fs/bpf/sandman"
+// Present while a pinned monitor is attached
+#define PIN_MARKER PIN_DIR "/link_on_exec"
+// bpffs holds no regular files, so the pinned policy list is kept next to it
+#define PIN_POLICIES "/run/sandman.policies"
 
 static volatile bool stop = false;
 
@@ -23,7 +24,13 @@ static void int_handler(int sig) {
     stop = true;
 }
 
-int load_nfa_rules(struct monitor *skel, const char *dat_file) {
+struct policy {
+    const char *dat_file;
+    const char *binary; // NULL for the default policy
+    __u32 id;
+};
+
+int load_nfa_rules(int table_fd, const char *dat_file) {
     FILE *f;
     char line[256];
     int line_num = 0;
@@ -35,23 +42,19 @@ int load_nfa_rules(struct monitor *skel, const char *dat_file) {
         return -1;
     }
 
-    const struct bpf_map *map = skel->maps.nfa_transition_map;
-
     while (fgets(line, sizeof(line), f)) {
         line_num++;
         if (line[0] == '#' || line[0] == '\n')
             continue;
 
-        struct nfa_key key = {};
-        struct nfa_value value = {};
-        int ret = sscanf(line, "%u %u %u %u", &key.current_state, &key.input_id, &value.next_state, &value.is_final_state);
-
-        if (ret != 4) {
+        struct nfa_key key;
+        struct nfa_value value;
+        if (!parse_nfa_rule(line, &key, &value)) {
             fprintf(stderr, "Warning: Skipping malformed line %d: %s", line_num, line);
             continue;
         }
 
-        ret = bpf_map__update_elem(map, &key, sizeof(key), &value, sizeof(value), BPF_ANY);
+        int ret = bpf_map_update_elem(table_fd, &key, &value, BPF_ANY);
         if (ret != 0) {
             fprintf(stderr, "ERROR: Failed to upload rule (line %d): %s\n", line_num, strerror(errno));
             fclose(f);
@@ -65,45 +68,496 @@ int load_nfa_rules(struct monitor *skel, const char *dat_file) {
     return 0;
 }
 
+int load_policy(struct monitor *skel, const struct policy *policy) {
+    int table_fd = create_policy_table();
+    if (table_fd < 0) {
+        return -1;
+    }
+
+    if (load_nfa_rules(table_fd, policy->dat_file)) {
+        close(table_fd);
+        return -1;
+    }
+
+    if (policy->binary) {
+        struct stat st;
+        if (stat(policy->binary, &st) != 0) {
+            fprintf(stderr, "ERROR: Failed to stat %s: %s\n", policy->binary, strerror(errno));
+            close(table_fd);
+            return -1;
+        }
+
+        // Same encoding as the kernel's internal dev_t
+        struct exe_key key = {};
+        key.dev = (major(st.st_dev) << 20) | minor(st.st_dev);
+        key.ino = st.st_ino;
+
+        int err = bpf_map__update_elem(skel->maps.nfa_policy_map, &key, sizeof(key), &policy->id, sizeof(policy->id),
+                                       BPF_ANY);
+        if (err) {
+            fprintf(stderr, "ERROR: Failed to bind %s: %s\n", policy->binary, strerror(-err));
+            close(table_fd);
+            return -1;
+        }
+    }
+
+    if (install_policy_table(skel, policy->id, table_fd)) {
+        return -1;
+    }
+
+    printf("LOADER: Policy %u from %s bound to %s\n", policy->id, policy->dat_file,
+           policy->binary ? policy->binary : "all other processes");
+    return 0;
+}
+
+// Writes "<state> <input-id> <hits>" lines, one file per policy
+int dump_profile(int map_fd, const struct policy *policies, int policy_count, const char *profile_file) {
+    int ncpus = libbpf_num_possible_cpus();
+    FILE *files[MAX_POLICIES] = {};
+    int rule_count = 0;
+    int err = 0;
+
+    if (ncpus <= 0) {
+        fprintf(stderr, "ERROR: Failed to get number of CPUs\n");
+        return -1;
+    }
+
+    __u64 *hits = calloc(ncpus, sizeof(__u64));
+    if (!hits) {
+        return -1;
+    }
+
+    for (int i = 0; i < policy_count; i++) {
+        char path[4096];
+        if (policy_count == 1) {
+            snprintf(path, sizeof(path), "%s", profile_file);
+        } else {
+            snprintf(path, sizeof(path), "%s.%u", profile_file, policies[i].id);
+        }
+
+        files[policies[i].id] = fopen(path, "w");
+        if (!files[policies[i].id]) {
+            fprintf(stderr, "ERROR: Failed to open profile file %s: %s\n", path, strerror(errno));
+            err = -1;
+            goto cleanup;
+        }
+        printf("LOADER: Writing profile of %s to %s\n", policies[i].dat_file, path);
+    }
+
+    struct profile_key key, next_key;
+    struct profile_key *prev = NULL;
+    while (bpf_map_get_next_key(map_fd, prev, &next_key) == 0) {
+        key = next_key;
+        prev = &key;
+
+        if (key.policy_id >= MAX_POLICIES || !files[key.policy_id]) {
+            continue;
+        }
+
+        if (bpf_map_lookup_elem(map_fd, &key, hits) != 0) {
+            continue;
+        }
+
+        __u64 total = 0;
+        for (int cpu = 0; cpu < ncpus; cpu++) {
+            total += hits[cpu];
+        }
+        fprintf(files[key.policy_id], "%u %u %llu\n", key.current_state, key.input_id, (unsigned long long)total);
+        rule_count++;
+    }
+
+    printf("LOADER: Wrote hit counts for %d transitions\n", rule_count);
+
+cleanup:
+    for (int i = 0; i < MAX_POLICIES; i++) {
+        if (files[i]) {
+            fclose(files[i]);
+        }
+    }
+    free(hits);
+    return err;
+}
+
+// Pinned maps are reused by the next load, so rules and per-process state
+// survive a loader restart
+static void set_pin_paths(struct monitor *skel) {
+    struct bpf_map *maps[] = {
+        skel->maps.nfa_state_map,  skel->maps.nfa_transition_map, skel->maps.nfa_policy_map,
+        skel->maps.task_policy_map, skel->maps.return_stack_map,  skel->maps.nfa_profile_map,
+    };
+    char path[PATH_MAX];
+
+    for (size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", PIN_DIR, bpf_map__name(maps[i]));
+        bpf_map__set_pin_path(maps[i], path);
+    }
+}
+
+// Pinned links keep the programs attached after the loader exits
+static int pin_links(struct monitor *skel) {
+    struct {
+        const char *name;
+        struct bpf_link *link;
+    } links[] = {
+        {"on_dummy_syscall", skel->links.on_dummy_syscall},
+        {"on_sys_enter", skel->links.on_sys_enter},
+        {"on_dummy_fentry", skel->links.on_dummy_fentry},
+        {"on_fork", skel->links.on_fork},
+        {"on_exit", skel->links.on_exit},
+        {"on_exec", skel->links.on_exec}, // last, it marks the pin as complete
+    };
+    char path[PATH_MAX];
+
+    for (size_t i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+        if (!links[i].link) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/link_%s", PIN_DIR, links[i].name);
+        int err = bpf_link__pin(links[i].link, path);
+        if (err) {
+            fprintf(stderr, "ERROR: Failed to pin %s: %s\n", path, strerror(-err));
+            return err;
+        }
+    }
+    return 0;
+}
+
+// A "<mode> <profile>" line, then one "<id>\t<nfa.dat>\t<binary>" line per
+// policy, so that a later loader can tell whether it would reuse the monitor
+// it was asked for
+static int record_policies(const struct policy *policies, int policy_count, int mode, bool profile) {
+    FILE *f = fopen(PIN_POLICIES, "w");
+    if (!f) {
+        fprintf(stderr, "ERROR: Failed to open %s: %s\n", PIN_POLICIES, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "%s %d\n", attach_mode_names[mode], profile);
+    for (int i = 0; i < policy_count; i++) {
+        fprintf(f, "%u\t%s\t%s\n", policies[i].id, policies[i].dat_file,
+                policies[i].binary ? policies[i].binary : "");
+    }
+
+    if (fclose(f)) {
+        fprintf(stderr, "ERROR: Failed to write %s: %s\n", PIN_POLICIES, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void free_recorded_policies(struct policy *policies, int policy_count) {
+    for (int i = 0; i < policy_count; i++) {
+        free((char *)policies[i].dat_file);
+        free((char *)policies[i].binary);
+    }
+}
+
+// Returns the number of policies recorded when the monitor was pinned
+static int read_recorded_policies(struct policy *policies, int *mode, bool *profile) {
+    FILE *f = fopen(PIN_POLICIES, "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: Failed to open %s: %s\n", PIN_POLICIES, strerror(errno));
+        return -1;
+    }
+
+    char line[2 * PATH_MAX + 16];
+    char mode_name[16];
+    int profile_on;
+    if (!fgets(line, sizeof(line), f) || sscanf(line, "%15s %d", mode_name, &profile_on) != 2 ||
+        (*mode = parse_attach_mode(mode_name)) < 0) {
+        fprintf(stderr, "ERROR: Malformed policy list %s\n", PIN_POLICIES);
+        fclose(f);
+        return -1;
+    }
+    *profile = profile_on;
+
+    int policy_count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *dat_file = strchr(line, '\t');
+        char *binary = dat_file ? strchr(dat_file + 1, '\t') : NULL;
+        char *end;
+        unsigned long id = strtoul(line, &end, 10);
+        if (!binary || end != dat_file || id >= MAX_POLICIES || policy_count == MAX_POLICIES) {
+            fprintf(stderr, "ERROR: Malformed policy list %s\n", PIN_POLICIES);
+            free_recorded_policies(policies, policy_count);
+            fclose(f);
+            return -1;
+        }
+        *dat_file++ = '\0';
+        *binary++ = '\0';
+        binary[strcspn(binary, "\n")] = '\0';
+
+        struct policy *policy = &policies[policy_count++];
+        policy->id = id;
+        policy->dat_file = strdup(dat_file);
+        policy->binary = *binary ? strdup(binary) : NULL;
+        if (!policy->dat_file || (*binary && !policy->binary)) {
+            fprintf(stderr, "ERROR: Out of memory\n");
+            free_recorded_policies(policies, policy_count);
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return policy_count;
+}
+
+static bool same_policies(const struct policy *a, int a_count, const struct policy *b, int b_count) {
+    if (a_count != b_count) {
+        return false;
+    }
+    for (int i = 0; i < a_count; i++) {
+        if (a[i].id != b[i].id || strcmp(a[i].dat_file, b[i].dat_file) != 0 || !a[i].binary != !b[i].binary ||
+            (a[i].binary && strcmp(a[i].binary, b[i].binary) != 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Removing the pins drops the last references, which detaches the programs
+// and frees the maps
+static int unload_pinned(void) {
+    if (unlink(PIN_POLICIES) && errno != ENOENT) {
+        fprintf(stderr, "ERROR: Failed to remove %s: %s\n", PIN_POLICIES, strerror(errno));
+        return 1;
+    }
+
+    DIR *dir = opendir(PIN_DIR);
+    if (!dir) {
+        if (errno == ENOENT) {
+            printf("LOADER: Nothing pinned in %s\n", PIN_DIR);
+            return 0;
+        }
+        fprintf(stderr, "ERROR: Failed to open %s: %s\n", PIN_DIR, strerror(errno));
+        return 1;
+    }
+
+    int err = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (unlinkat(dirfd(dir), entry->d_name, 0)) {
+            fprintf(stderr, "ERROR: Failed to unpin %s: %s\n", entry->d_name, strerror(errno));
+            err = 1;
+        }
+    }
+    closedir(dir);
+
+    if (!err && rmdir(PIN_DIR)) {
+        fprintf(stderr, "ERROR: Failed to remove %s: %s\n", PIN_DIR, strerror(errno));
+        err = 1;
+    }
+
+    if (!err) {
+        printf("eBPF monitor unpinned and unloaded.\n");
+    }
+    return err;
+}
+
+static void wait_for_signal(void) {
+    while (!stop) {
+        sleep(1);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m tp|raw_tp|fentry] [-p <profile.raw>] [-P] <nfa.dat>[:<binary>]...\n", prog);
+    fprintf(stderr, "       %s unload\n", prog);
+    fprintf(stderr, "  <nfa.dat>:<binary>  enforce the policy on processes running <binary>\n");
+    fprintf(stderr, "  <nfa.dat>           enforce the policy on every process not bound to another policy\n");
+    fprintf(stderr, "  -m  how the monitor attaches to the dummy syscall (default: tp)\n");
+    fprintf(stderr, "  -p  record per-transition hit counts and write them on exit\n");
+    fprintf(stderr, "  -P  pin the monitor in %s so it keeps running after exit, or reuse it if pinned\n", PIN_DIR);
+    fprintf(stderr, "  unload  detach and remove a pinned monitor\n");
+}
+
 int main(int argc, char **argv) {
     struct monitor *skel;
+    const char *profile_file = NULL;
+    int mode = ATTACH_TP;
+    bool mode_given = false;
+    bool pin = false;
+    bool pinned = false;
+    int opt;
     int err;
 
-    if (argc < 2) {
+    if (argc == 2 && strcmp(argv[1], "unload") == 0) {
+        return unload_pinned();
+    }
+
+    while ((opt = getopt(argc, argv, "m:p:P")) != -1) {
+        switch (opt) {
+        case 'm':
+            mode = parse_attach_mode(optarg);
+            if (mode < 0) {
+                fprintf(stderr, "ERROR: Unknown attach mode: %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            mode_given = true;
+            break;
+        case 'p':
+            profile_file = optarg;
+            break;
+        case 'P':
+            pin = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
         fprintf(stderr, "ERROR: Missing argument.\n");
-        fprintf(stderr, "Usage: %s <nfa.dat>\n", argv[0]);
+        usage(argv[0]);
         return 1;
     }
-    const char *dat_file = argv[1];
+
+    struct policy policies[MAX_POLICIES];
+    int policy_count = 0;
+    bool has_default = false;
+    __u32 next_id = DEFAULT_POLICY + 1;
+
+    for (int i = optind; i < argc; i++) {
+        char *sep = strchr(argv[i], ':');
+        if (sep && next_id == MAX_POLICIES) {
+            fprintf(stderr, "ERROR: At most %d binaries can be sandboxed.\n", MAX_POLICIES - 1);
+            return 1;
+        }
+
+        struct policy *policy = &policies[policy_count++];
+        policy->dat_file = argv[i];
+        policy->binary = NULL;
+
+        if (sep) {
+            *sep = '\0';
+            policy->binary = sep + 1;
+            policy->id = next_id++;
+        } else if (has_default) {
+            fprintf(stderr, "ERROR: Only one policy can be given without a binary.\n");
+            return 1;
+        } else {
+            policy->id = DEFAULT_POLICY;
+            has_default = true;
+        }
+    }
 
     signal(SIGINT, int_handler);
     signal(SIGTERM, int_handler);
 
-    skel = monitor__open_and_load();
+    // The pinned monitor kept checking while no loader ran; there is nothing
+    // to load, only the profile to collect on exit. It is only reused as it
+    // was asked for, so nobody is left believing a new policy is enforced.
+    if (pin && access(PIN_MARKER, F_OK) == 0) {
+        struct policy pinned_policies[MAX_POLICIES];
+        int pinned_mode;
+        bool pinned_profile;
+        int pinned_count = read_recorded_policies(pinned_policies, &pinned_mode, &pinned_profile);
+        if (pinned_count < 0) {
+            return 1;
+        }
+        bool same = same_policies(policies, policy_count, pinned_policies, pinned_count);
+        free_recorded_policies(pinned_policies, pinned_count);
+
+        if (!same) {
+            fprintf(stderr, "ERROR: The pinned monitor enforces other policies, run '%s unload' first.\n", argv[0]);
+            return 1;
+        }
+        if (mode_given && mode != pinned_mode) {
+            fprintf(stderr, "ERROR: The pinned monitor is attached with -m %s, run '%s unload' first.\n",
+                    attach_mode_names[pinned_mode], argv[0]);
+            return 1;
+        }
+        if (profile_file && !pinned_profile) {
+            fprintf(stderr, "ERROR: The pinned monitor was started without -p, run '%s unload' first.\n", argv[0]);
+            return 1;
+        }
+
+        printf("eBPF monitor reused from %s, policies are not reloaded. Press Ctrl+C to exit.\n", PIN_DIR);
+        wait_for_signal();
+
+        err = 0;
+        if (profile_file) {
+            int map_fd = bpf_obj_get(PIN_DIR "/nfa_profile_map");
+            if (map_fd < 0) {
+                fprintf(stderr, "ERROR: Failed to open pinned profile map: %s\n", strerror(errno));
+                return 1;
+            }
+            err = dump_profile(map_fd, policies, policy_count, profile_file);
+            close(map_fd);
+        }
+
+        printf("\neBPF monitor left pinned in %s, run '%s unload' to remove it.\n", PIN_DIR, argv[0]);
+        return -err;
+    }
+
+    skel = monitor__open();
     if (!skel) {
         fprintf(stderr, "ERROR: Failed to open BPF skeleton\n");
         return 1;
     }
 
-    err = load_nfa_rules(skel, dat_file);
+    skel->rodata->profile = profile_file != NULL;
+    select_attach_mode(skel, mode);
+    if (pin) {
+        set_pin_paths(skel);
+    }
+
+    err = monitor__load(skel);
     if (err) {
-        fprintf(stderr, "ERROR: Failed to load nfa rules.\n");
+        fprintf(stderr, "ERROR: Failed to load BPF skeleton: %s\n", strerror(-err));
         goto cleanup;
     }
 
+    for (int i = 0; i < policy_count; i++) {
+        err = load_policy(skel, &policies[i]);
+        if (err) {
+            fprintf(stderr, "ERROR: Failed to load nfa rules.\n");
+            goto cleanup;
+        }
+    }
+
     err = monitor__attach(skel);
     if (err) {
         fprintf(stderr, "ERROR: Failed to attach BPF skeleton: %s\n", strerror(-err));
         goto cleanup;
     }
 
-    printf("eBPF monitor loaded and attached to sys_dummy. Press Ctrl+C to exit.\n");
-    while (!stop) {
-        sleep(1);
+    if (pin) {
+        // Recorded before the links, whose last pin marks the monitor as reusable
+        err = record_policies(policies, policy_count, mode, profile_file != NULL);
+        if (err) {
+            goto cleanup;
+        }
+        err = pin_links(skel);
+        if (err) {
+            goto cleanup;
+        }
+        pinned = true;
+    }
+
+    printf("eBPF monitor loaded and attached to sys_dummy (%s). Press Ctrl+C to exit.\n", attach_mode_names[mode]);
+    wait_for_signal();
+
+    if (profile_file) {
+        err = dump_profile(bpf_map__fd(skel->maps.nfa_profile_map), policies, policy_count, profile_file);
     }
 
 cleanup:
     monitor__destroy(skel);
-    printf("\neBPF monitor detached and unloaded.\n");
+    if (pin && !pinned) {
+        // Do not leave a half pinned monitor for the next start to trip over
+        unload_pinned();
+    } else if (pinned) {
+        printf("\neBPF monitor left pinned in %s, run '%s unload' to remove it.\n", PIN_DIR, argv[0]);
+    } else {
+        printf("\neBPF monitor detached and unloaded.\n");
+    }
     return -err;
 }
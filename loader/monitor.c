@@ -1,11 +1,34 @@
 #include "vmlinux.h"
+#include <bpf/bpf_core_read.h>
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
 
 #define STATE_START 0
 #define STATE_FINAL 69420
 
+#define DUMMY_SYSCALL_NR 462
+
+// Input id of the check after a call into a monitored function returns
+#define RETURN_ID 1
+#define NO_PUSH 0xFFFFFFFF
+#define MAX_CALL_DEPTH 64
+
+#if defined(__TARGET_ARCH_x86)
+#define SYSCALL_PREFIX "__x64_"
+#elif defined(__TARGET_ARCH_arm64)
+#define SYSCALL_PREFIX "__arm64_"
+#else
+#define SYSCALL_PREFIX ""
+#endif
+
 #define SIGKILL 9
 
+#define MAX_POLICIES 64
+#define DEFAULT_POLICY 0
+
+#define REPLAY_MAX_EVENTS (1 << 20)
+#define REPLAY_RESET 0
+
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
     __uint(max_entries, 10240);
@@ -21,21 +44,130 @@ struct nfa_key {
 struct nfa_value {
     __u32 next_state;
     __u32 is_final_state;
+    __u32 push_state;
 };
 
-struct {
+// Template for the per-policy transition tables created by the loader
+struct nfa_table {
     __uint(type, BPF_MAP_TYPE_HASH);
     __uint(max_entries, 10240);
     __type(key, struct nfa_key);
     __type(value, struct nfa_value);
+};
+
+// Set by monitor-replay to benchmark a dense layout: the tables are then
+// arrays of <state> * dense_columns + <column> cells, with the column of an
+// input id in dense_column_map. Unused cells and ids hold DENSE_NONE.
+const volatile bool dense_table = false;
+const volatile __u32 dense_columns = 0;
+
+#define DENSE_NONE 0xFFFFFFFF
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+} dense_column_map SEC(".maps");
+
+// Slot DEFAULT_POLICY applies to processes not bound to any other policy
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __uint(max_entries, MAX_POLICIES);
+    __type(key, __u32);
+    __array(values, struct nfa_table);
 } nfa_transition_map SEC(".maps");
 
-SEC("tracepoint/syscalls/sys_enter_dummy")
-int on_dummy_syscall(struct trace_event_raw_sys_enter *ctx) {
+struct exe_key {
+    __u32 dev;
+    __u32 pad;
+    __u64 ino;
+};
 
-    __u32 pid = bpf_get_current_pid_tgid() >> 32;
+// Binary identity -> policy, filled by the loader
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_POLICIES);
+    __type(key, struct exe_key);
+    __type(value, __u32);
+} nfa_policy_map SEC(".maps");
+
+// PID -> policy, bound on exec
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 10240);
+    __type(key, __u32);
+    __type(value, __u32);
+} task_policy_map SEC(".maps");
 
-    int input_id = (int)ctx->args[0];
+struct return_stack {
+    __u32 depth;
+    __u32 states[MAX_CALL_DEPTH];
+};
+
+// PID -> states to resume in when monitored calls return (hierarchical
+// policies). Threads are not supported, they would share one stack.
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 10240);
+    __type(key, __u32);
+    __type(value, struct return_stack);
+} return_stack_map SEC(".maps");
+
+static const struct return_stack empty_stack = {};
+
+// Set by the loader before load to record per-transition hit counts
+const volatile bool profile = false;
+
+struct profile_key {
+    __u32 policy_id;
+    __u32 current_state;
+    __u32 input_id;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+    __uint(max_entries, 10240);
+    __type(key, struct profile_key);
+    __type(value, __u64);
+} nfa_profile_map SEC(".maps");
+
+// A process that was forked from a bound process and has not exec'd since
+// runs the bound binary. Unbound, on_fork could not record its policy.
+static __always_inline bool lost_fork_binding(void) {
+    struct task_struct *task = (struct task_struct *)bpf_get_current_task();
+    struct task_struct *parent = BPF_CORE_READ(task, group_leader, real_parent);
+    __u64 parent_exec_id = BPF_CORE_READ(task, group_leader, parent_exec_id);
+
+    if (BPF_CORE_READ(task, group_leader, self_exec_id) != parent_exec_id ||
+        BPF_CORE_READ(parent, self_exec_id) != parent_exec_id) {
+        return false;
+    }
+
+    __u32 parent_pid = BPF_CORE_READ(parent, tgid);
+    return bpf_map_lookup_elem(&task_policy_map, &parent_pid) != NULL;
+}
+
+// Replays pass enforce = false: they have no task to kill and must not flood
+// the trace pipe. The flag is constant after inlining, so it costs nothing.
+// The return stack is per process, so only the main thread may use it.
+static __always_inline int check_transition(__u32 pid, int input_id, bool enforce, bool main_thread) {
+
+    __u32 policy_id = DEFAULT_POLICY;
+    __u32 *policy_ptr = bpf_map_lookup_elem(&task_policy_map, &pid);
+    if (policy_ptr) {
+        policy_id = *policy_ptr;
+    } else if (enforce && lost_fork_binding()) {
+        bpf_printk("MONITOR: PID %d - Policy of parent not inherited\n", pid);
+        bpf_send_signal(SIGKILL);
+        return -6;
+    }
+
+    void *nfa_table = bpf_map_lookup_elem(&nfa_transition_map, &policy_id);
+    if (!nfa_table) {
+        // No policy for this process
+        return 0;
+    }
 
     __u32 current_state = STATE_START;
     __u32 next_state = STATE_START;
@@ -46,8 +178,10 @@ int on_dummy_syscall(struct trace_event_raw_sys_enter *ctx) {
     }
 
     if (current_state == STATE_FINAL) {
-        bpf_printk("MONITOR: PID %d - Transition after Final State\n", pid);
-        bpf_send_signal(SIGKILL);
+        if (enforce) {
+            bpf_printk("MONITOR: PID %d - Transition after Final State\n", pid);
+            bpf_send_signal(SIGKILL);
+        }
         bpf_map_delete_elem(&nfa_state_map, &pid);
 
         return -2;
@@ -58,28 +192,246 @@ int on_dummy_syscall(struct trace_event_raw_sys_enter *ctx) {
     key.input_id = input_id;
 
     struct nfa_value *transition;
-    transition = bpf_map_lookup_elem(&nfa_transition_map, &key);
+    if (dense_table) {
+        __u32 *column = bpf_map_lookup_elem(&dense_column_map, &key.input_id);
+        __u32 cell = column && *column != DENSE_NONE ? current_state * dense_columns + *column : DENSE_NONE;
+        transition = bpf_map_lookup_elem(nfa_table, &cell);
+        if (transition && transition->next_state == DENSE_NONE) {
+            transition = NULL;
+        }
+    } else {
+        transition = bpf_map_lookup_elem(nfa_table, &key);
+    }
 
     if (!transition) {
-        bpf_printk("MONITOR: PID %d - Invalid Transition from %u, Input: %u\n", pid, current_state, input_id);
-        bpf_send_signal(SIGKILL);
+        if (enforce) {
+            bpf_printk("MONITOR: PID %d - Invalid Transition from %u, Input: %u\n", pid, current_state, input_id);
+            bpf_send_signal(SIGKILL);
+        }
         bpf_map_delete_elem(&nfa_state_map, &pid);
 
         return -1;
     }
 
+    if (profile) {
+        struct profile_key pkey = {policy_id, current_state, input_id};
+        __u64 *hits = bpf_map_lookup_elem(&nfa_profile_map, &pkey);
+        if (hits) {
+            (*hits)++;
+        } else {
+            __u64 one = 1;
+            bpf_map_update_elem(&nfa_profile_map, &pkey, &one, BPF_NOEXIST);
+        }
+    }
+
     __u32 is_final_state = transition->is_final_state;
-    if (is_final_state) {
+    if (!main_thread && (input_id == RETURN_ID || transition->push_state != NO_PUSH)) {
+        if (enforce) {
+            bpf_printk("MONITOR: PID %d - Call stack used by a thread\n", pid);
+            bpf_send_signal(SIGKILL);
+        }
+        bpf_map_delete_elem(&nfa_state_map, &pid);
+
+        return -5;
+    } else if (input_id == RETURN_ID) {
+        struct return_stack *stack = bpf_map_lookup_elem(&return_stack_map, &pid);
+        if (!stack || stack->depth == 0 || stack->depth > MAX_CALL_DEPTH) {
+            if (enforce) {
+                bpf_printk("MONITOR: PID %d - Return without call from %u\n", pid, current_state);
+                bpf_send_signal(SIGKILL);
+            }
+            bpf_map_delete_elem(&nfa_state_map, &pid);
+
+            return -3;
+        }
+        stack->depth--;
+        next_state = stack->states[stack->depth & (MAX_CALL_DEPTH - 1)];
+    } else if (transition->push_state != NO_PUSH) {
+        struct return_stack *stack = bpf_map_lookup_elem(&return_stack_map, &pid);
+        if (!stack) {
+            bpf_map_update_elem(&return_stack_map, &pid, &empty_stack, BPF_NOEXIST);
+            stack = bpf_map_lookup_elem(&return_stack_map, &pid);
+        }
+        if (!stack || stack->depth >= MAX_CALL_DEPTH) {
+            if (enforce) {
+                bpf_printk("MONITOR: PID %d - Call depth exceeds %d\n", pid, MAX_CALL_DEPTH);
+                bpf_send_signal(SIGKILL);
+            }
+            bpf_map_delete_elem(&nfa_state_map, &pid);
+
+            return -4;
+        }
+        stack->states[stack->depth & (MAX_CALL_DEPTH - 1)] = transition->push_state;
+        stack->depth++;
+        next_state = transition->next_state;
+    } else if (is_final_state) {
         next_state = STATE_FINAL;
     } else {
         next_state = transition->next_state;
     }
 
-    bpf_printk("MONITOR: PID %d - Transition: %u -> %u, Input: %u\n", pid, current_state, next_state, input_id);
+    if (enforce) {
+        bpf_printk("MONITOR: PID %d - Transition: %u -> %u, Input: %u\n", pid, current_state, next_state, input_id);
+    }
 
     bpf_map_update_elem(&nfa_state_map, &pid, &next_state, BPF_ANY);
 
     return 0;
 }
 
+static __always_inline int check_current(int input_id) {
+    __u64 pid_tgid = bpf_get_current_pid_tgid();
+    return check_transition(pid_tgid >> 32, input_id, true, (__u32)pid_tgid == pid_tgid >> 32);
+}
+
+// Binds the process to the policy of its new binary and restarts its automaton
+SEC("tp/sched/sched_process_exec")
+int on_exec(struct trace_event_raw_sched_process_exec *ctx) {
+    __u32 pid = bpf_get_current_pid_tgid() >> 32;
+    struct task_struct *task = (struct task_struct *)bpf_get_current_task();
+    struct inode *inode = BPF_CORE_READ(task, mm, exe_file, f_inode);
+
+    struct exe_key key = {};
+    key.dev = BPF_CORE_READ(inode, i_sb, s_dev);
+    key.ino = BPF_CORE_READ(inode, i_ino);
+
+    bpf_map_delete_elem(&nfa_state_map, &pid);
+    bpf_map_delete_elem(&return_stack_map, &pid);
+
+    __u32 *policy_ptr = bpf_map_lookup_elem(&nfa_policy_map, &key);
+    if (policy_ptr) {
+        // Running a bound binary under another policy would bypass its own, so fail closed
+        if (bpf_map_update_elem(&task_policy_map, &pid, policy_ptr, BPF_ANY)) {
+            bpf_printk("MONITOR: PID %d - Could not bind policy %u\n", pid, *policy_ptr);
+            bpf_send_signal(SIGKILL);
+        }
+    } else {
+        bpf_map_delete_elem(&task_policy_map, &pid);
+    }
+
+    return 0;
+}
+
+// A forked process keeps running its parent's binary, so it keeps its policy.
+// No helper can signal the child from here, so a child that could not be
+// bound is killed at its first check instead (see lost_fork_binding).
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(on_fork, struct task_struct *parent, struct task_struct *child) {
+    if (child->pid != child->tgid) {
+        return 0;
+    }
+
+    __u32 parent_pid = parent->tgid;
+    __u32 child_pid = child->tgid;
+
+    __u32 *policy_ptr = bpf_map_lookup_elem(&task_policy_map, &parent_pid);
+    if (policy_ptr) {
+        if (bpf_map_update_elem(&task_policy_map, &child_pid, policy_ptr, BPF_ANY)) {
+            bpf_printk("MONITOR: PID %d - Could not bind policy %u\n", child_pid, *policy_ptr);
+        }
+    } else {
+        bpf_map_delete_elem(&task_policy_map, &child_pid);
+    }
+
+    return 0;
+}
+
+// Frees the entries of an exiting process so a reused PID starts clean and
+// the maps do not fill up. The leader may exit before its other threads, so
+// only the last thread of the group frees them.
+SEC("tp/sched/sched_process_exit")
+int on_exit(struct trace_event_raw_sched_process_template *ctx) {
+    struct task_struct *task = (struct task_struct *)bpf_get_current_task();
+    if (BPF_CORE_READ(task, signal, live.counter) != 0) {
+        return 0;
+    }
+
+    __u32 pid = bpf_get_current_pid_tgid() >> 32;
+
+    bpf_map_delete_elem(&task_policy_map, &pid);
+    bpf_map_delete_elem(&nfa_state_map, &pid);
+    bpf_map_delete_elem(&return_stack_map, &pid);
+
+    return 0;
+}
+
+// The loader enables exactly one of the attach modes below
+
+SEC("tracepoint/syscalls/sys_enter_dummy")
+int on_dummy_syscall(struct trace_event_raw_sys_enter *ctx) {
+    return check_current((int)ctx->args[0]);
+}
+
+// Skips the per-syscall tracepoint; runs for every syscall, so filter early
+SEC("raw_tracepoint/sys_enter")
+int on_sys_enter(struct bpf_raw_tracepoint_args *ctx) {
+    if (ctx->args[1] != DUMMY_SYSCALL_NR) {
+        return 0;
+    }
+
+    struct pt_regs *regs = (struct pt_regs *)ctx->args[0];
+    return check_current((int)PT_REGS_PARM1_CORE_SYSCALL(regs));
+}
+
+SEC("fentry/" SYSCALL_PREFIX "sys_dummy")
+int BPF_PROG(on_dummy_fentry, struct pt_regs *regs) {
+    check_current((int)PT_REGS_PARM1_CORE_SYSCALL(regs));
+    return 0;
+}
+
+// Input ids for the replay program, filled by monitor-replay. REPLAY_RESET
+// restarts the automaton, as an exec would.
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, REPLAY_MAX_EVENTS);
+    __type(key, __u32);
+    __type(value, __u32);
+} replay_trace_map SEC(".maps");
+
+__u64 replay_checks = 0;
+__u64 replay_violations = 0;
+__u64 replay_ns = 0;
+
+struct replay_ctx {
+    __u32 pid;
+    bool skip_checks;
+};
+
+static long replay_step(__u32 index, void *ctx) {
+    struct replay_ctx *rctx = ctx;
+    __u32 *input_id = bpf_map_lookup_elem(&replay_trace_map, &index);
+    if (!input_id) {
+        return 1;
+    }
+
+    if (*input_id == REPLAY_RESET) {
+        bpf_map_delete_elem(&nfa_state_map, &rctx->pid);
+        bpf_map_delete_elem(&return_stack_map, &rctx->pid);
+        return 0;
+    }
+
+    if (rctx->skip_checks) {
+        return 0;
+    }
+
+    if (check_transition(rctx->pid, *input_id, false, true) < 0) {
+        replay_violations++;
+    }
+    replay_checks++;
+    return 0;
+}
+
+// Not attached anywhere: run with BPF_PROG_TEST_RUN and (pid, event count,
+// skip checks) as arguments to time the checks on a stock kernel
+SEC("?raw_tp")
+int replay(struct bpf_raw_tracepoint_args *ctx) {
+    struct replay_ctx rctx = {.pid = ctx->args[0], .skip_checks = ctx->args[2]};
+
+    __u64 start = bpf_ktime_get_ns();
+    bpf_loop(ctx->args[1], replay_step, &rctx, 0);
+    replay_ns += bpf_ktime_get_ns() - start;
+
+    return 0;
+}
+
 char LICENSE[] SEC("license") = "GPL";
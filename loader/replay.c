@@ -0,0 +1,467 @@
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define REPLAY_MAX_EVENTS (1 << 20)
+#define REPLAY_RESET 0
+#define REPLAY_PID 0x7ffffff0 // above PID_MAX_LIMIT, never a real process
+
+#define STATE_FINAL 69420
+#define RETURN_ID 1
+#define MAX_CALL_DEPTH 64
+
+#define DENSE_NONE 0xFFFFFFFF
+#define DENSE_MAX_CELLS (1 << 22)
+#define DENSE_BATCH 4096
+
+struct layout {
+    const char *name;
+    enum bpf_map_type type;
+    __u32 map_flags;
+    // One array cell per state and input id instead of one hash entry per rule
+    bool dense;
+};
+
+static const struct layout layouts[] = {
+    {"hash", BPF_MAP_TYPE_HASH, 0, false},
+    {"hash-noprealloc", BPF_MAP_TYPE_HASH, BPF_F_NO_PREALLOC, false},
+    {"lru_hash", BPF_MAP_TYPE_LRU_HASH, 0, false},
+    {"array", BPF_MAP_TYPE_ARRAY, 0, true},
+};
+
+#define LAYOUT_COUNT (sizeof(layouts) / sizeof(layouts[0]))
+
+struct rule {
+    struct nfa_key key;
+    struct nfa_value value;
+};
+
+static struct rule *rules;
+static int rule_count;
+
+// Dense layout: input id -> column, or DENSE_NONE for ids the policy never uses
+static __u32 *id_columns;
+static __u32 id_count;
+static __u32 dense_rows;
+static __u32 dense_columns;
+
+static int compare_rules(const void *a, const void *b) {
+    const struct rule *ra = a, *rb = b;
+    if (ra->key.current_state != rb->key.current_state) {
+        return ra->key.current_state < rb->key.current_state ? -1 : 1;
+    }
+    return ra->key.input_id < rb->key.input_id ? -1 : ra->key.input_id > rb->key.input_id;
+}
+
+static int load_rules(const char *dat_file) {
+    FILE *f = fopen(dat_file, "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: Failed to open dat file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    rules = calloc(MAX_RULES, sizeof(*rules));
+    if (!rules) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        fclose(f);
+        return -1;
+    }
+
+    char line[256];
+    while (rule_count < MAX_RULES && fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (parse_nfa_rule(line, &rules[rule_count].key, &rules[rule_count].value)) {
+            rule_count++;
+        }
+    }
+    fclose(f);
+
+    if (rule_count == 0) {
+        fprintf(stderr, "ERROR: No rules in %s\n", dat_file);
+        return -1;
+    }
+
+    // Sorted by state so the walk below can find the rules of a state quickly
+    qsort(rules, rule_count, sizeof(*rules), compare_rules);
+    return 0;
+}
+
+// Rows are the states, columns the input ids used by the policy in
+// increasing order, as in sandman-verify's table
+static int build_columns(void) {
+    for (int i = 0; i < rule_count; i++) {
+        if (rules[i].key.input_id >= id_count) {
+            id_count = rules[i].key.input_id + 1;
+        }
+        if (rules[i].key.current_state >= dense_rows) {
+            dense_rows = rules[i].key.current_state + 1;
+        }
+    }
+
+    id_columns = malloc(id_count * sizeof(*id_columns));
+    if (!id_columns) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        return -1;
+    }
+    memset(id_columns, 0xff, id_count * sizeof(*id_columns));
+
+    for (int i = 0; i < rule_count; i++) {
+        id_columns[rules[i].key.input_id] = 0;
+    }
+    for (__u32 id = 0; id < id_count; id++) {
+        if (id_columns[id] != DENSE_NONE) {
+            id_columns[id] = dense_columns++;
+        }
+    }
+    return 0;
+}
+
+static int upload_dense_table(int table_fd, __u32 cells) {
+    __u32 *keys = calloc(cells, sizeof(*keys));
+    struct nfa_value *values = calloc(cells, sizeof(*values));
+    int err = 0;
+
+    if (!keys || !values) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        err = -ENOMEM;
+        goto cleanup;
+    }
+
+    for (__u32 cell = 0; cell < cells; cell++) {
+        keys[cell] = cell;
+        values[cell].next_state = DENSE_NONE;
+    }
+    for (int i = 0; i < rule_count; i++) {
+        values[rules[i].key.current_state * dense_columns + id_columns[rules[i].key.input_id]] = rules[i].value;
+    }
+
+    for (__u32 first = 0; first < cells; first += DENSE_BATCH) {
+        __u32 count = cells - first < DENSE_BATCH ? cells - first : DENSE_BATCH;
+        err = bpf_map_update_batch(table_fd, &keys[first], &values[first], &count, NULL);
+        if (err) {
+            fprintf(stderr, "ERROR: Failed to upload rules: %s\n", strerror(errno));
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    free(keys);
+    free(values);
+    return err;
+}
+
+static int first_rule_of(__u32 state) {
+    int lo = 0, hi = rule_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (rules[mid].key.current_state < state) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int can_take(const struct rule *r, int depth) {
+    if (r->key.input_id == RETURN_ID) {
+        return depth > 0;
+    }
+    return r->value.push_state == NO_PUSH || depth < MAX_CALL_DEPTH;
+}
+
+// Random walk over the policy that calls and returns like a real process,
+// restarting from the start state whenever it ends
+static int synthesize_trace(__u32 *trace, int events) {
+    __u32 stack[MAX_CALL_DEPTH];
+    __u32 state = 0;
+    int depth = 0;
+    int n = 0;
+
+    while (n < events) {
+        int first = first_rule_of(state);
+        int candidates = 0;
+        for (int i = first; i < rule_count && rules[i].key.current_state == state; i++) {
+            candidates += can_take(&rules[i], depth);
+        }
+
+        if (candidates == 0) {
+            if (n == 0 || trace[n - 1] == REPLAY_RESET) {
+                fprintf(stderr, "ERROR: The start state has no transitions\n");
+                return -1;
+            }
+            trace[n++] = REPLAY_RESET;
+            state = 0;
+            depth = 0;
+            continue;
+        }
+
+        int pick = rand() % candidates;
+        const struct rule *r = &rules[first];
+        for (;; r++) {
+            if (can_take(r, depth) && pick-- == 0) {
+                break;
+            }
+        }
+
+        trace[n++] = r->key.input_id;
+        if (r->key.input_id == RETURN_ID) {
+            state = stack[--depth];
+        } else if (r->value.push_state != NO_PUSH) {
+            stack[depth++] = r->value.push_state;
+            state = r->value.next_state;
+        } else if (r->value.is_final_state) {
+            state = STATE_FINAL;
+        } else {
+            state = r->value.next_state;
+        }
+    }
+
+    return n;
+}
+
+// Text traces as for sandman-verify: one trace of space separated ids per line
+static int read_trace(const char *path, __u32 *trace, int events) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: Failed to open trace file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    int n = 0;
+    while (n < events && getline(&line, &cap, f) > 0) {
+        char *p = line, *end;
+        int start = n;
+        while (n < events) {
+            unsigned long id = strtoul(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            trace[n++] = id;
+            p = end;
+        }
+        if (n > start && n < events) {
+            trace[n++] = REPLAY_RESET;
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return n;
+}
+
+static int bench_layout(const struct layout *layout, const __u32 *trace, int events, int runs) {
+    struct monitor *skel;
+    int err;
+
+    __u64 cells = (__u64)dense_rows * dense_columns;
+    if (layout->dense && cells > DENSE_MAX_CELLS) {
+        printf("%-16s unavailable (%llu cells)\n", layout->name, (unsigned long long)cells);
+        return 0;
+    }
+
+    skel = monitor__open();
+    if (!skel) {
+        fprintf(stderr, "ERROR: Failed to open BPF skeleton\n");
+        return -1;
+    }
+
+    // Only the replay program is loaded, so no custom kernel is needed
+    bpf_program__set_autoload(skel->progs.on_dummy_syscall, false);
+    bpf_program__set_autoload(skel->progs.on_sys_enter, false);
+    bpf_program__set_autoload(skel->progs.on_dummy_fentry, false);
+    bpf_program__set_autoload(skel->progs.on_exec, false);
+    bpf_program__set_autoload(skel->progs.on_fork, false);
+    bpf_program__set_autoload(skel->progs.on_exit, false);
+    bpf_program__set_autoload(skel->progs.replay, true);
+
+    struct bpf_map *table_template = bpf_map__inner_map(skel->maps.nfa_transition_map);
+    bpf_map__set_type(table_template, layout->type);
+    bpf_map__set_map_flags(table_template, layout->map_flags);
+    if (layout->dense) {
+        bpf_map__set_key_size(table_template, sizeof(__u32));
+        bpf_map__set_max_entries(table_template, cells);
+        bpf_map__set_max_entries(skel->maps.dense_column_map, id_count);
+        skel->rodata->dense_table = true;
+        skel->rodata->dense_columns = dense_columns;
+    }
+
+    err = monitor__load(skel);
+    if (err) {
+        printf("%-16s unavailable (load failed: %s)\n", layout->name, strerror(-err));
+        goto cleanup;
+    }
+
+    int table_fd;
+    if (layout->dense) {
+        table_fd = bpf_map_create(layout->type, "nfa_table", sizeof(__u32), sizeof(struct nfa_value), cells, NULL);
+        if (table_fd < 0) {
+            fprintf(stderr, "ERROR: Failed to create transition table: %s\n", strerror(errno));
+            err = table_fd;
+            goto cleanup;
+        }
+
+        err = upload_dense_table(table_fd, cells);
+        for (__u32 id = 0; !err && id < id_count; id++) {
+            err = bpf_map__update_elem(skel->maps.dense_column_map, &id, sizeof(id), &id_columns[id],
+                                       sizeof(id_columns[id]), BPF_ANY);
+            if (err) {
+                fprintf(stderr, "ERROR: Failed to upload columns: %s\n", strerror(-err));
+            }
+        }
+        if (err) {
+            close(table_fd);
+            goto cleanup;
+        }
+    } else {
+        table_fd = create_policy_table_as(layout->type, layout->map_flags);
+        if (table_fd < 0) {
+            err = table_fd;
+            goto cleanup;
+        }
+
+        for (int i = 0; i < rule_count; i++) {
+            err = bpf_map_update_elem(table_fd, &rules[i].key, &rules[i].value, BPF_ANY);
+            if (err) {
+                fprintf(stderr, "ERROR: Failed to upload rule: %s\n", strerror(errno));
+                close(table_fd);
+                goto cleanup;
+            }
+        }
+    }
+
+    err = install_policy_table(skel, DEFAULT_POLICY, table_fd);
+    if (err) {
+        goto cleanup;
+    }
+
+    for (__u32 i = 0; i < (__u32)events; i++) {
+        err = bpf_map__update_elem(skel->maps.replay_trace_map, &i, sizeof(i), &trace[i], sizeof(trace[i]), BPF_ANY);
+        if (err) {
+            fprintf(stderr, "ERROR: Failed to upload trace: %s\n", strerror(-err));
+            goto cleanup;
+        }
+    }
+
+    // The trace is replayed once more without checks, which times the loop
+    // and the resets alone so they can be taken out
+    double best = 0;
+    __u64 checks = 0, violations = 0;
+    for (int run = 0; run < runs; run++) {
+        __u64 ns[2];
+        for (int skip_checks = 0; skip_checks < 2; skip_checks++) {
+            __u32 pid = REPLAY_PID;
+            bpf_map__delete_elem(skel->maps.nfa_state_map, &pid, sizeof(pid), 0);
+            bpf_map__delete_elem(skel->maps.return_stack_map, &pid, sizeof(pid), 0);
+            skel->bss->replay_checks = 0;
+            skel->bss->replay_violations = 0;
+            skel->bss->replay_ns = 0;
+
+            __u64 args[3] = {REPLAY_PID, events, skip_checks};
+            LIBBPF_OPTS(bpf_test_run_opts, opts, .ctx_in = args, .ctx_size_in = sizeof(args));
+            err = bpf_prog_test_run_opts(bpf_program__fd(skel->progs.replay), &opts);
+            if (err) {
+                fprintf(stderr, "ERROR: Failed to run replay: %s\n", strerror(errno));
+                goto cleanup;
+            }
+
+            ns[skip_checks] = skel->bss->replay_ns;
+            if (!skip_checks) {
+                checks = skel->bss->replay_checks;
+                violations = skel->bss->replay_violations;
+            }
+        }
+
+        double check_ns = ns[0] > ns[1] ? (double)(ns[0] - ns[1]) : 0;
+        double per_check = checks ? check_ns / checks : 0;
+        if (run == 0 || per_check < best) {
+            best = per_check;
+        }
+    }
+
+    printf("%-16s %10.1f ns/check %10llu checks %8llu violations\n", layout->name, best,
+           (unsigned long long)checks, (unsigned long long)violations);
+
+cleanup:
+    monitor__destroy(skel);
+    return err;
+}
+
+int main(int argc, char **argv) {
+    const char *trace_file = NULL;
+    int events = 100000;
+    int runs = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            events = atoi(optarg);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n events] [-r runs] [-t trace.txt] <nfa.dat> [layout...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-n events] [-r runs] [-t trace.txt] <nfa.dat> [layout...]\n", argv[0]);
+        return 1;
+    }
+
+    if (events <= 0 || events > REPLAY_MAX_EVENTS || runs <= 0) {
+        fprintf(stderr, "ERROR: Invalid event or run count.\n");
+        return 1;
+    }
+
+    if (load_rules(argv[optind]) || build_columns()) {
+        return 1;
+    }
+
+    __u32 *trace = calloc(events, sizeof(*trace));
+    if (!trace) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        return 1;
+    }
+
+    events = trace_file ? read_trace(trace_file, trace, events) : synthesize_trace(trace, events);
+    if (events <= 0) {
+        return 1;
+    }
+
+    if (optind + 1 == argc) {
+        for (size_t i = 0; i < LAYOUT_COUNT; i++) {
+            bench_layout(&layouts[i], trace, events, runs);
+        }
+        return 0;
+    }
+
+    for (int i = optind + 1; i < argc; i++) {
+        size_t l = 0;
+        while (l < LAYOUT_COUNT && strcmp(argv[i], layouts[l].name) != 0) {
+            l++;
+        }
+        if (l == LAYOUT_COUNT) {
+            fprintf(stderr, "ERROR: Unknown layout: %s\n", argv[i]);
+            return 1;
+        }
+        bench_layout(&layouts[l], trace, events, runs);
+    }
+
+    return 0;
+}
@@ -1,12 +1,21 @@
 #include "CfgPass.h"
+#include "PolicyClasses.h"
 
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <map>
 #include <queue>
 #include <random>
 #include <sstream>
+#include <tuple>
 #include <unordered_set>
 
 using namespace llvm;
@@ -14,11 +23,78 @@ using namespace std;
 
 AnalysisKey CfgPass::Key;
 
+static cl::opt<unsigned> NfaThreads(
+    "sandman-threads",
+    cl::desc("Threads used to build per-function NFA fragments (0: all cores)"),
+    cl::init(0));
+
+static cl::opt<bool> Hierarchical(
+    "sandman-hierarchical",
+    cl::desc("Compile one automaton per function with call/return symbols, checked with a return stack"),
+    cl::init(false));
+
+static cl::opt<bool> PreciseIntrinsics(
+    "sandman-precise-intrinsics",
+    cl::desc("Only treat intrinsics as lib calls where the backend will emit a libc call"),
+    cl::init(false));
+
+static cl::opt<unsigned> MemInlineThreshold(
+    "sandman-mem-inline-threshold",
+    cl::desc("Largest constant memcpy/memmove/memset size in bytes assumed to be expanded inline "
+             "(default: the target's threshold)"),
+    cl::init(0));
+
+static cl::opt<unsigned> MaxStates(
+    "sandman-max-states",
+    cl::desc("Largest automaton in states before functions are coarsened (0: no limit)"),
+    cl::init(0));
+
+static cl::opt<unsigned> MaxTransitions(
+    "sandman-max-transitions",
+    cl::desc("Largest automaton in transitions before functions are coarsened (0: no limit)"),
+    cl::init(0));
+
+static cl::opt<unsigned> MaxSeconds(
+    "sandman-max-seconds",
+    cl::desc("Wall time in seconds one determinization round may take before functions are coarsened (0: no limit)"),
+    cl::init(0));
+
+static cl::list<string> MonitorClasses(
+    "sandman-monitor",
+    cl::desc("Only monitor libc functions of these classes: file, network, process, memory"),
+    cl::CommaSeparated);
+
+static cl::opt<string> MonitorList(
+    "sandman-monitor-list",
+    cl::desc("File with libc functions to monitor, one per line, in addition to -sandman-monitor"),
+    cl::init(""));
+
+static cl::opt<bool> MergeIds(
+    "sandman-merge-ids",
+    cl::desc("Give call sites that label exactly the same transitions one shared id"),
+    cl::init(true));
+
+static cl::opt<string> LibrarySummary(
+    "sandman-library",
+    cl::desc("Build a library: write a summary automaton of every exported function to this file instead of nfa.dat"),
+    cl::init(""));
+
+static cl::list<string> SummaryFiles(
+    "sandman-summaries",
+    cl::desc("Library summaries (from -sandman-library) to check calls into those libraries against"),
+    cl::CommaSeparated);
+
+static cl::opt<unsigned> IdBase(
+    "sandman-id-base",
+    cl::desc("First input id of this module (default: random, above the ids of every loaded summary)"),
+    cl::init(0));
+
 const string EP = "EP";
 const string ENTRY = "<ENTRY>";
 const string EXIT = "<EXIT>";
 const string MENTRY = "main-" + ENTRY;
 const string MEXIT = "main-" + EXIT;
+const string END = "<END>";
 
 using StateSet = set<string>;
 using NfaTransitions = map<string, map<string, StateSet>>;
@@ -58,15 +134,17 @@ StateSet epsilonClosure(const StateSet &states, const NfaTransitions &nfa) {
     return closure;
 }
 
-StateSet move(const StateSet &states, const string &input, const NfaTransitions &nfa) {
-    StateSet reachableStates;
+// The states reachable on every input, gathered in one pass over the set
+// rather than one pass per symbol of the alphabet
+map<string, StateSet> moveAll(const StateSet &states, const NfaTransitions &nfa) {
+    map<string, StateSet> reachableStates;
     for (const auto &state : states) {
         auto nfaStateIt = nfa.find(state);
         if (nfaStateIt != nfa.end()) {
-            const auto &transitions = nfaStateIt->second;
-            auto inputIt = transitions.find(input);
-            if (inputIt != transitions.end()) {
-                reachableStates.insert(inputIt->second.begin(), inputIt->second.end());
+            for (const auto &[input, nextStates] : nfaStateIt->second) {
+                if (input != EP) {
+                    reachableStates[input].insert(nextStates.begin(), nextStates.end());
+                }
             }
         }
     }
@@ -94,32 +172,44 @@ struct MinNfaResult {
     MinNfaStatesMap states;
     string startStateName;
     set<string> acceptStateNames;
+    // False when the budget ran out before all states were built
+    bool complete = true;
+};
+
+// Limits on the automata built in one round. The counters are shared, so the
+// per-function automata of hierarchical mode are bounded as a whole.
+struct DeterminizeBudget {
+    size_t maxStates = 0;
+    size_t maxTransitions = 0;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    size_t states = 0;
+    size_t transitions = 0;
+
+    bool exceeded() const {
+        return (maxStates && states > maxStates) || (maxTransitions && transitions > maxTransitions) ||
+               (deadline != chrono::steady_clock::time_point::max() && chrono::steady_clock::now() > deadline);
+    }
 };
 
 MinNfaResult convertNfaToMinNfa(
     const NfaTransitions &nfa,
     const string &nfaStartState,
-    const StateSet &nfaAcceptStates) {
+    const StateSet &nfaAcceptStates,
+    DeterminizeBudget *budget = nullptr) {
     MinNfaResult minNfaResult;
     map<StateSet, string> stateSetToNfaName;
     queue<StateSet> q;
-    set<string> alphabet;
     int nfaStateCounter = 0;
 
-    for (const auto &pair : nfa) {
-        for (const auto &transPair : pair.second) {
-            if (transPair.first != EP) {
-                alphabet.insert(transPair.first);
-            }
-        }
-    }
-
     StateSet startSet = epsilonClosure({nfaStartState}, nfa);
     if (stateSetToNfaName.find(startSet) == stateSetToNfaName.end()) {
         minNfaResult.startStateName = "S" + to_string(nfaStateCounter++);
         stateSetToNfaName[startSet] = minNfaResult.startStateName;
         minNfaResult.states[minNfaResult.startStateName] = {startSet, false};
         q.push(startSet);
+        if (budget) {
+            budget->states++;
+        }
     } else {
         minNfaResult.startStateName = stateSetToNfaName[startSet];
     }
@@ -129,11 +219,7 @@ MinNfaResult convertNfaToMinNfa(
         q.pop();
         string currentNfaName = stateSetToNfaName[currentNfaStates];
 
-        for (const string &input : alphabet) {
-            StateSet nextNfaStatesRaw = move(currentNfaStates, input, nfa);
-            if (nextNfaStatesRaw.empty()) {
-                continue;
-            }
+        for (const auto &[input, nextNfaStatesRaw] : moveAll(currentNfaStates, nfa)) {
             StateSet nextNfaStatesClosure = epsilonClosure(nextNfaStatesRaw, nfa);
 
             string nextNfaName;
@@ -142,10 +228,21 @@ MinNfaResult convertNfaToMinNfa(
                 stateSetToNfaName[nextNfaStatesClosure] = nextNfaName;
                 minNfaResult.states[nextNfaName] = {nextNfaStatesClosure, false};
                 q.push(nextNfaStatesClosure);
+                if (budget) {
+                    budget->states++;
+                }
             } else {
                 nextNfaName = stateSetToNfaName[nextNfaStatesClosure];
             }
             minNfaResult.transitions[currentNfaName][input] = nextNfaName;
+
+            if (budget) {
+                budget->transitions++;
+                if (budget->exceeded()) {
+                    minNfaResult.complete = false;
+                    return minNfaResult;
+                }
+            }
         }
     }
 
@@ -203,55 +300,700 @@ void generateNfaDot(const MinNfaResult &nfa) {
     }
 }
 
-void generateDatFiles(const MinNfaResult &nfa, const map<std::string, int> &inputSymbolToId) {
-    const int FINAL_STATE = 69420;
+const int FINAL_STATE = 69420;
+const int NO_PUSH = -1;
+
+struct DatRule {
+    int currentStateId;
+    int inputId;
+    int nextStateId;
+    int isFinal;
+    // State to resume in when the callee entered by this rule returns
+    int pushStateId = NO_PUSH;
+};
+
+// Numbers states in the order given, skipping the monitor's final state id
+class StateNumbering {
+    map<string, int> ids;
+    int count = 0;
+
+  public:
+    int get(const string &name) {
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        if (count == FINAL_STATE) {
+            count++;
+        }
+        ids[name] = count;
+        return count++;
+    }
+};
+
+vector<DatRule> buildDatRules(const MinNfaResult &nfa, const map<std::string, int> &inputSymbolToId) {
+    StateNumbering stateIds;
+    vector<DatRule> rules;
 
+    stateIds.get(nfa.startStateName);
+    for (const auto &statePair : nfa.states) {
+        stateIds.get(statePair.first);
+    }
+
+    for (const auto &outerPair : nfa.transitions) {
+        string currentStateName = outerPair.first;
+        for (const auto &innerPair : outerPair.second) {
+            string inputSymbol = innerPair.first;
+            string nextStateName = innerPair.second;
+
+            int isFinal = nfa.acceptStateNames.count(nextStateName);
+
+            if (inputSymbolToId.count(inputSymbol)) {
+                int currentStateId = stateIds.get(currentStateName);
+                int inputId = inputSymbolToId.at(inputSymbol);
+                int nextStateId = stateIds.get(nextStateName);
+
+                rules.push_back({currentStateId, inputId, nextStateId, isFinal});
+            }
+        }
+    }
+
+    return rules;
+}
+
+void generateDatFiles(const vector<DatRule> &rules) {
     error_code EC;
     raw_fd_ostream DatFile("nfa.dat", EC);
 
     if (EC) {
         errs() << "Error opening nfa.dat: " << EC.message() << "\n";
     } else {
-        int count = 0;
-        int errorStateId = -1;
-        map<std::string, int> stateNameToId;
+        for (const DatRule &r : rules) {
+            DatFile << r.currentStateId << " " << r.inputId << " " << r.nextStateId << " " << r.isFinal;
+            if (r.pushStateId != NO_PUSH) {
+                DatFile << " " << r.pushStateId;
+            }
+            DatFile << "\n";
+        }
 
-        stateNameToId[nfa.startStateName] = count++;
-        stateNameToId["STATE_ERROR"] = errorStateId;
+        DatFile.close();
+    }
+}
 
-        for (const auto &statePair : nfa.states) {
-            if (count == FINAL_STATE) {
-                count++;
+// Maps every instrumented id to a site key that stays stable across rebuilds
+// of unchanged code, so a profile recorded against one build applies to the next.
+void generateSitesFile(const vector<pair<int, string>> &idToSite) {
+    error_code EC;
+    raw_fd_ostream SitesFile("nfa.sites", EC);
+
+    if (EC) {
+        errs() << "Error opening nfa.sites: " << EC.message() << "\n";
+    } else {
+        for (const auto &[id, site] : idToSite) {
+            SitesFile << id << " " << site << "\n";
+        }
+    }
+}
+
+// The NFA fragment of one function: one state per lib call site plus the
+// function's entry and exit. It depends on nothing outside F.
+struct FunctionNfa {
+    NfaTransitions nfa;
+    map<string, int> funcId;
+    set<string> acceptStates;
+};
+
+const int TARGET_EXIT = -1;
+
+// With userCallIds set (hierarchical mode), calls to those functions become
+// call symbols and every other non-lib call is ignored. A summarized function
+// may make its calls in any order and any number of times before it returns.
+FunctionNfa buildFunctionNfa(Function &F, const map<CallInst *, string> &libCallNames, const map<CallInst *, int> &libCallIds,
+                             const set<CallInst *> &ignoredCalls, const set<string> &libraryExports,
+                             const map<CallInst *, int> *userCallIds, bool summarize) {
+    FunctionNfa fragment;
+
+    string fnName = F.getName().str();
+    string fnEntry = fnName + "-" + ENTRY;
+    string fnExit = fnName + "-" + EXIT;
+
+    // Calls that take part in the automaton, in program order. Blocks
+    // without any are never given a state of their own.
+    vector<CallInst *> calls;
+    vector<string> callStates;
+    map<BasicBlock *, int> firstCall;
+    vector<BasicBlock *> blocks;
+
+    int blockIndex = 0;
+    for (BasicBlock &B : F) {
+        blocks.push_back(&B);
+        int itrmCount = 1;
+        int callCount = 1;
+        for (Instruction &I : B) {
+            CallInst *CI = dyn_cast<CallInst>(&I);
+            if (!CI || !CI->getCalledFunction()) {
+                continue;
+            }
+
+            Function *CalledF = CI->getCalledFunction();
+            string state;
+            if (libCallNames.count(CI)) {
+                state = fnName + "-" + to_string(blockIndex) + "_i" + to_string(itrmCount++);
+            } else if (userCallIds && userCallIds->count(CI)) {
+                state = fnName + "-" + to_string(blockIndex) + "_c" + to_string(callCount++);
+            } else if (CalledF->isIntrinsic() || userCallIds || ignoredCalls.count(CI)) {
+                continue;
+            } else {
+                // Placeholder for non-lib functions
+                state = CalledF->getName().str() + "-" + EXIT;
             }
 
-            const string &stateName = statePair.first;
-            if (stateNameToId.find(stateName) == stateNameToId.end()) {
-                stateNameToId[stateName] = count++;
+            if (!firstCall.count(&B)) {
+                firstCall[&B] = calls.size();
             }
+            calls.push_back(CI);
+            callStates.push_back(state);
         }
 
-        for (const auto &outerPair : nfa.transitions) {
-            string currentStateName = outerPair.first;
-            for (const auto &innerPair : outerPair.second) {
-                string inputSymbol = innerPair.first;
-                string nextStateName = innerPair.second;
+        if (successors(&B).empty() && isa<UnreachableInst>(B.getTerminator())) {
+            fragment.acceptStates.insert(fnExit);
+        }
+        blockIndex++;
+    }
 
-                int isFinal = nfa.acceptStateNames.count(nextStateName);
+    // Calls (or TARGET_EXIT) reachable from the start of each block through
+    // call-free blocks only, solved as a fixpoint to handle loops
+    map<BasicBlock *, set<int>> targets;
+    for (BasicBlock *B : blocks) {
+        if (firstCall.count(B)) {
+            targets[B] = {firstCall.at(B)};
+        } else if (successors(B).empty()) {
+            targets[B] = {TARGET_EXIT};
+        }
+    }
 
-                if (inputSymbolToId.count(inputSymbol) &&
-                    stateNameToId.count(currentStateName) &&
-                    stateNameToId.count(nextStateName)) {
-                    int currentStateId = stateNameToId.at(currentStateName);
-                    int inputId = inputSymbolToId.at(inputSymbol);
-                    int nextStateId = stateNameToId.at(nextStateName);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (BasicBlock *B : blocks) {
+            if (firstCall.count(B) || successors(B).empty()) {
+                continue;
+            }
+            set<int> &T = targets[B];
+            size_t before = T.size();
+            for (BasicBlock *Succ : successors(B)) {
+                const set<int> &succTargets = targets[Succ];
+                T.insert(succTargets.begin(), succTargets.end());
+            }
+            changed |= T.size() != before;
+        }
+    }
 
-                    DatFile << currentStateId << " " << inputId << " " << nextStateId << " " << isFinal << "\n";
+    auto addEdges = [&](const string &from, const set<int> &to) {
+        for (int target : to) {
+            if (target == TARGET_EXIT) {
+                fragment.nfa[from][EP].insert(fnExit);
+                continue;
+            }
+
+            CallInst *CI = calls[target];
+            if (libCallNames.count(CI)) {
+                // Handle transition for lib calls
+                int id = libCallIds.at(CI);
+                string transition = libCallNames.at(CI) + "(): " + to_string(id);
+                fragment.nfa[from][transition].insert(callStates[target]);
+                fragment.funcId[transition] = id;
+            } else if (userCallIds) {
+                int id = userCallIds->at(CI);
+                string transition = "call " + CI->getCalledFunction()->getName().str() + "(): " + to_string(id);
+                fragment.nfa[from][transition].insert(callStates[target]);
+                fragment.funcId[transition] = id;
+            } else {
+                Function *CalledF = CI->getCalledFunction();
+                string funcEntry = CalledF->getName().str() + "-" + ENTRY;
+                fragment.nfa[from][EP].insert(funcEntry);
+                if (CalledF->isDeclaration() && !libraryExports.count(CalledF->getName().str())) {
+                    fragment.nfa[funcEntry][EP].insert(callStates[target]);
                 }
             }
         }
+    };
+
+    if (summarize) {
+        set<int> all;
+        for (size_t i = 0; i < calls.size(); i++) {
+            all.insert(i);
+            // Symbols loop on the entry, calls into other functions return to it
+            if (libCallNames.count(calls[i]) || userCallIds) {
+                callStates[i] = fnEntry;
+            } else {
+                fragment.nfa[callStates[i]][EP].insert(fnEntry);
+            }
+        }
+        addEdges(fnEntry, all);
+        fragment.nfa[fnEntry][EP].insert(fnExit);
+        return fragment;
+    }
 
-        DatFile.close();
+    addEdges(fnEntry, targets[&F.getEntryBlock()]);
+
+    for (size_t i = 0; i < calls.size(); i++) {
+        BasicBlock *B = calls[i]->getParent();
+        if (i + 1 < calls.size() && calls[i + 1]->getParent() == B) {
+            addEdges(callStates[i], {(int)i + 1});
+        } else if (successors(B).empty()) {
+            addEdges(callStates[i], {TARGET_EXIT});
+        } else {
+            set<int> next;
+            for (BasicBlock *Succ : successors(B)) {
+                next.insert(targets[Succ].begin(), targets[Succ].end());
+            }
+            addEdges(callStates[i], next);
+        }
+    }
+
+    return fragment;
+}
+
+// Merges the fragments into one NFA. Accepting states end the trace, so
+// their transitions are dropped.
+NfaTransitions mergeFragments(const vector<FunctionNfa> &fragments, const vector<FunctionNfa> &libraryFragments,
+                              map<string, int> &funcId, set<string> &nfaAcceptStates) {
+    NfaTransitions nfa;
+
+    funcId.clear();
+    for (const vector<FunctionNfa> *list : {&fragments, &libraryFragments}) {
+        for (const FunctionNfa &fragment : *list) {
+            for (const auto &[state, transitions] : fragment.nfa) {
+                for (const auto &[input, nextStates] : transitions) {
+                    nfa[state][input].insert(nextStates.begin(), nextStates.end());
+                }
+            }
+            funcId.insert(fragment.funcId.begin(), fragment.funcId.end());
+            nfaAcceptStates.insert(fragment.acceptStates.begin(), fragment.acceptStates.end());
+        }
+    }
+
+    // Post processing to remove transition from accepting states
+    for (const string &acceptState : nfaAcceptStates) {
+        if (nfa.count(acceptState)) {
+            nfa.erase(acceptState);
+        }
+    }
+
+    return nfa;
+}
+
+// Merges the fragments into one NFA and determinizes it from main's entry
+MinNfaResult determinizeModule(const vector<FunctionNfa> &fragments, const vector<FunctionNfa> &libraryFragments,
+                               map<string, int> &funcId, DeterminizeBudget *budget) {
+    set<string> nfaAcceptStates = {MEXIT};
+    NfaTransitions nfa = mergeFragments(fragments, libraryFragments, funcId, nfaAcceptStates);
+    return convertNfaToMinNfa(nfa, MENTRY, nfaAcceptStates, budget);
+}
+
+// What a program may see of a library export from its call to its return,
+// as a DFA over the library's input ids. State 0 is the start.
+struct ExportSummary {
+    struct Rule {
+        int from;
+        int id;
+        int to;
+        string libFn;
+    };
+    vector<Rule> rules;
+    set<int> returns;
+    // States in which the process may end inside the library
+    set<int> ends;
+};
+
+struct LibrarySummaries {
+    map<string, ExportSummary> exports;
+    vector<pair<int, string>> idToSite;
+    int maxId = 0;
+};
+
+// Determinizes the library from the entry of each export. Every export gets
+// the whole budget, as each is composed into programs on its own.
+bool determinizeExports(const vector<Function *> &exports, const vector<FunctionNfa> &fragments,
+                        const vector<FunctionNfa> &libraryFragments, map<string, ExportSummary> &summaries,
+                        const DeterminizeBudget *budget) {
+    map<string, int> funcId;
+    set<string> acceptStates;
+    NfaTransitions nfa = mergeFragments(fragments, libraryFragments, funcId, acceptStates);
+
+    summaries.clear();
+    for (const Function *F : exports) {
+        string fnName = F->getName().str();
+        string fnExit = fnName + "-" + EXIT;
+
+        DeterminizeBudget exportBudget;
+        if (budget) {
+            exportBudget = *budget;
+        }
+        MinNfaResult dfa = convertNfaToMinNfa(nfa, fnName + "-" + ENTRY, acceptStates, budget ? &exportBudget : nullptr);
+        if (!dfa.complete) {
+            return false;
+        }
+
+        ExportSummary &summary = summaries[fnName];
+        StateNumbering stateIds;
+        stateIds.get(dfa.startStateName);
+        for (const auto &[state, info] : dfa.states) {
+            int stateId = stateIds.get(state);
+            for (const string &acceptState : acceptStates) {
+                if (info.nfaStates.count(acceptState)) {
+                    summary.ends.insert(stateId);
+                    break;
+                }
+            }
+            if (info.nfaStates.count(fnExit) && !acceptStates.count(fnExit)) {
+                summary.returns.insert(stateId);
+            }
+        }
+
+        for (const auto &[state, transitions] : dfa.transitions) {
+            for (const auto &[input, nextState] : transitions) {
+                string libFn = input.substr(0, input.find("()"));
+                summary.rules.push_back({stateIds.get(state), funcId.at(input), stateIds.get(nextState), libFn});
+            }
+        }
     }
+    return true;
+}
+
+// A library export as seen from a program: its summary between the same
+// entry and exit states every other called function has
+FunctionNfa exportNfa(const string &fnName, const ExportSummary &summary) {
+    FunctionNfa fragment;
+    auto stateName = [&](int state) { return fnName + "-s" + to_string(state); };
+
+    fragment.nfa[fnName + "-" + ENTRY][EP].insert(stateName(0));
+    for (const ExportSummary::Rule &r : summary.rules) {
+        string transition = r.libFn + "(): " + to_string(r.id);
+        fragment.nfa[stateName(r.from)][transition].insert(stateName(r.to));
+        fragment.funcId[transition] = r.id;
+    }
+    for (int state : summary.returns) {
+        fragment.nfa[stateName(state)][EP].insert(fnName + "-" + EXIT);
+    }
+    for (int state : summary.ends) {
+        fragment.nfa[stateName(state)][EP].insert(fnName + "-" + END);
+        fragment.acceptStates.insert(fnName + "-" + END);
+    }
+
+    return fragment;
+}
+
+// Sidecar of a library build. It carries the library's sites too, so
+// profiles of programs can name them.
+void generateLibrarySummary(const string &path, const map<string, ExportSummary> &summaries,
+                            const vector<pair<int, string>> &idToSite) {
+    error_code EC;
+    raw_fd_ostream SummaryFile(path, EC);
+
+    if (EC) {
+        errs() << "Error opening " << path << ": " << EC.message() << "\n";
+        return;
+    }
+
+    SummaryFile << "# sandman library summary\n";
+    if (!idToSite.empty()) {
+        auto [first, last] = minmax_element(idToSite.begin(), idToSite.end());
+        SummaryFile << "ids " << first->first << " " << last->first << "\n";
+    }
+    for (const auto &[id, site] : idToSite) {
+        SummaryFile << "site " << id << " " << site << "\n";
+    }
+
+    for (const auto &[fnName, summary] : summaries) {
+        SummaryFile << "export " << fnName << "\n";
+        for (const ExportSummary::Rule &r : summary.rules) {
+            SummaryFile << "rule " << r.from << " " << r.id << " " << r.to << " " << r.libFn << "\n";
+        }
+        for (int state : summary.returns) {
+            SummaryFile << "return " << state << "\n";
+        }
+        for (int state : summary.ends) {
+            SummaryFile << "end " << state << "\n";
+        }
+    }
+}
+
+// Loads every -sandman-summaries file. Libraries must not share ids, as the
+// checks inside them cannot be renumbered.
+LibrarySummaries loadLibrarySummaries() {
+    LibrarySummaries summaries;
+    vector<tuple<int, int, string>> ranges;
+
+    for (const string &path : SummaryFiles) {
+        ifstream summaryFile(path);
+        if (!summaryFile.is_open()) {
+            errs() << "ERROR: Could not open library summary " << path << ".\n";
+            exit(1);
+        }
+
+        ExportSummary *current = nullptr;
+        string line;
+        int lineNumber = 0;
+        while (getline(summaryFile, line)) {
+            lineNumber++;
+            istringstream fields(line);
+            string kind;
+            if (!(fields >> kind) || kind[0] == '#') {
+                continue;
+            }
+
+            bool valid;
+            if (kind == "ids") {
+                int first, last;
+                valid = fields >> first >> last && RETURN_ID < first && first <= last;
+                for (const auto &[otherFirst, otherLast, otherPath] : ranges) {
+                    if (valid && first <= otherLast && otherFirst <= last) {
+                        errs() << "ERROR: Library summaries " << otherPath << " and " << path
+                               << " share input ids, rebuild one with another -sandman-id-base.\n";
+                        exit(1);
+                    }
+                }
+                if (valid) {
+                    ranges.push_back({first, last, path});
+                    summaries.maxId = max(summaries.maxId, last);
+                }
+            } else if (kind == "site") {
+                int id;
+                string site;
+                valid = bool(fields >> id >> site);
+                if (valid) {
+                    summaries.idToSite.push_back({id, site});
+                }
+            } else if (kind == "export") {
+                string fnName;
+                valid = bool(fields >> fnName);
+                if (valid) {
+                    auto [it, inserted] = summaries.exports.insert({fnName, {}});
+                    if (!inserted) {
+                        errs() << "WARNING: " << fnName
+                               << " is exported by more than one library summary, using the first.\n";
+                    }
+                    current = inserted ? &it->second : nullptr;
+                }
+            } else if (kind == "rule") {
+                ExportSummary::Rule r;
+                valid = bool(fields >> r.from >> r.id >> r.to >> r.libFn);
+                if (valid && current) {
+                    current->rules.push_back(r);
+                }
+            } else if (kind == "return" || kind == "end") {
+                int state;
+                valid = bool(fields >> state);
+                if (valid && current) {
+                    (kind == "return" ? current->returns : current->ends).insert(state);
+                }
+            } else {
+                valid = false;
+            }
+
+            if (!valid) {
+                errs() << "ERROR: Malformed library summary " << path << " at line " << lineNumber << ".\n";
+                exit(1);
+            }
+        }
+    }
+
+    return summaries;
+}
+
+// Determinizes every function on its own. Return rules count towards the
+// budget as they take a slot in the policy table like any other rule.
+bool determinizeFunctions(const vector<Function *> &fns, const vector<FunctionNfa> &fragments,
+                          map<const Function *, MinNfaResult> &dfas, DeterminizeBudget *budget) {
+    dfas.clear();
+    for (size_t i = 0; i < fns.size(); i++) {
+        string fnName = fns[i]->getName().str();
+        StateSet acceptStates = fragments[i].acceptStates;
+        acceptStates.insert(fnName + "-" + EXIT);
+        MinNfaResult &dfa = dfas[fns[i]] = convertNfaToMinNfa(fragments[i].nfa, fnName + "-" + ENTRY, acceptStates, budget);
+        if (!dfa.complete) {
+            return false;
+        }
+
+        if (budget && fnName != "main") {
+            for (const auto &[state, info] : dfa.states) {
+                budget->transitions += info.nfaStates.count(fnName + "-" + EXIT);
+            }
+            if (budget->exceeded()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// A call rule enters the callee's start state and pushes the caller's state
+// after the call; the monitor pops it again on RETURN_ID, which is allowed
+// wherever the callee may return.
+vector<DatRule> buildHierarchicalRules(const vector<Function *> &fns, const vector<FunctionNfa> &fragments,
+                                       map<const Function *, MinNfaResult> &dfas, const map<CallInst *, int> &userCallIds) {
+    map<int, const Function *> callees;
+    set<int> tailCalls;
+    for (const auto &[CI, id] : userCallIds) {
+        callees[id] = CI->getCalledFunction();
+        if (CI->isMustTailCall()) {
+            tailCalls.insert(id);
+        }
+    }
+
+    StateNumbering stateIds;
+    auto stateName = [](const Function *F, const string &state) { return F->getName().str() + "/" + state; };
+
+    const Function *mainFn = nullptr;
+    for (const Function *F : fns) {
+        if (F->getName() == "main") {
+            mainFn = F;
+            stateIds.get(stateName(F, dfas[F].startStateName));
+        }
+    }
+
+    MinNfaResult combined;
+    if (mainFn) {
+        combined.startStateName = stateName(mainFn, dfas[mainFn].startStateName);
+    }
+
+    vector<DatRule> rules;
+    for (size_t i = 0; i < fns.size(); i++) {
+        const Function *F = fns[i];
+        const MinNfaResult &dfa = dfas[F];
+        string fnExit = F->getName().str() + "-" + EXIT;
+
+        for (const auto &[state, info] : dfa.states) {
+            string name = stateName(F, state);
+            int stateId = stateIds.get(name);
+            combined.states[name] = info;
+
+            if (F == mainFn) {
+                if (info.isAcceptState) {
+                    combined.acceptStateNames.insert(name);
+                }
+            } else if (info.nfaStates.count(fnExit)) {
+                rules.push_back({stateId, RETURN_ID, stateId, 0});
+                combined.transitions[name]["<RETURN>"] = name;
+            }
+        }
+
+        for (const auto &[state, transitions] : dfa.transitions) {
+            for (const auto &[input, nextState] : transitions) {
+                int id = fragments[i].funcId.at(input);
+                int stateId = stateIds.get(stateName(F, state));
+                int nextStateId = stateIds.get(stateName(F, nextState));
+                combined.transitions[stateName(F, state)][input] = stateName(F, nextState);
+
+                auto callee = callees.find(id);
+                if (callee != callees.end()) {
+                    const Function *G = callee->second;
+                    int calleeStart = stateIds.get(stateName(G, dfas[G].startStateName));
+                    // A musttail callee replaces the caller's frame and returns on its behalf
+                    int pushStateId = tailCalls.count(id) ? NO_PUSH : nextStateId;
+                    rules.push_back({stateId, id, calleeStart, 0, pushStateId});
+                } else {
+                    int isFinal = F == mainFn && dfa.acceptStateNames.count(nextState);
+                    rules.push_back({stateId, id, nextStateId, isFinal});
+                }
+            }
+        }
+    }
+
+    generateNfaDot(combined);
+    return rules;
+}
+
+// Call sites whose ids label exactly the same transitions cannot be told
+// apart by the monitor, so every such class is given its lowest id. Returns
+// the id each site id is replaced with.
+map<int, int> mergeEquivalentIds(vector<DatRule> &rules, const vector<pair<int, string>> &idToSite) {
+    using Signature = vector<tuple<int, int, int, int>>;
+    map<int, Signature> signatures;
+    for (const auto &[id, site] : idToSite) {
+        signatures[id];
+    }
+    for (const DatRule &r : rules) {
+        auto it = signatures.find(r.inputId);
+        if (it != signatures.end()) {
+            it->second.push_back({r.currentStateId, r.nextStateId, r.isFinal, r.pushStateId});
+        }
+    }
+
+    map<Signature, int> classes;
+    map<int, int> representative;
+    for (auto &[id, signature] : signatures) {
+        std::sort(signature.begin(), signature.end());
+        representative[id] = classes.insert({signature, id}).first->second;
+    }
+
+    vector<DatRule> merged;
+    set<pair<int, int>> seen;
+    for (DatRule r : rules) {
+        auto it = representative.find(r.inputId);
+        if (it != representative.end()) {
+            r.inputId = it->second;
+        }
+        if (seen.insert({r.currentStateId, r.inputId}).second) {
+            merged.push_back(r);
+        }
+    }
+    rules = merged;
+
+    return representative;
+}
+
+void generateCoarseningReport(const vector<Function *> &fns, const set<const Function *> &summarized) {
+    error_code EC;
+    raw_fd_ostream ReportFile("nfa.coarsened", EC);
+
+    if (EC) {
+        errs() << "Error opening nfa.coarsened: " << EC.message() << "\n";
+        return;
+    }
+
+    for (const Function *F : fns) {
+        if (summarized.count(F)) {
+            ReportFile << F->getName() << "\n";
+        }
+    }
+
+    if (!summarized.empty()) {
+        errs() << "WARNING: Determinization budget exceeded, summarized " << summarized.size()
+               << " function(s), see nfa.coarsened.\n";
+    }
+}
+
+unordered_set<string> loadMonitoredFunctions() {
+    unordered_set<string> fns;
+
+    for (const string &policyClass : MonitorClasses) {
+        if (!addPolicyClass(policyClass, fns)) {
+            errs() << "ERROR: Unknown policy class " << policyClass << ".\n";
+            exit(1);
+        }
+    }
+
+    if (!MonitorList.empty()) {
+        ifstream listFile(MonitorList);
+        if (!listFile.is_open()) {
+            errs() << "ERROR: Could not open monitor list " << MonitorList << ".\n";
+            exit(1);
+        }
+
+        string line;
+        while (getline(listFile, line)) {
+            // Hand-edited lists may carry CRLF endings or stray indentation
+            StringRef name = StringRef(line).trim();
+            if (!name.empty() && !name.starts_with("#")) {
+                fns.insert(name.str());
+            }
+        }
+    }
+
+    return fns;
 }
 
 unordered_set<string> loadFunctionList() {
@@ -277,145 +1019,384 @@ unordered_set<string> loadFunctionList() {
 
 CfgPass::CfgPass() {
     FnsList = loadFunctionList();
+    MonitoredFns = loadMonitoredFunctions();
 }
 
 bool CfgPass::isLibFn(const string &nameToFind) const {
     return FnsList.count(nameToFind) > 0;
 }
 
-CfgPassResult CfgPass::run(Module &M, ModuleAnalysisManager &AM) {
-    Result R;
+bool CfgPass::isMonitored(const string &funcName) const {
+    return MonitoredFns.empty() || MonitoredFns.count(funcName) > 0;
+}
 
-    NfaTransitions nfa;
-    map<std::string, int> funcId;
-    set<std::string> nfaAcceptStates;
+string CfgPass::libFnName(const Function *CalledF) const {
+    if (!CalledF) {
+        return "";
+    }
+
+    string funcName;
+    if (CalledF->isIntrinsic()) {
+        StringRef baseName = Intrinsic::getBaseName(CalledF->getIntrinsicID());
+        if (baseName.starts_with("llvm.")) {
+            funcName = baseName.drop_front(5).str();
+        } else {
+            funcName = baseName.str();
+        }
+    } else {
+        funcName = CalledF->getName().str();
+    }
+
+    return isLibFn(funcName) ? funcName : "";
+}
+
+bool CfgPass::lowersToLibCall(const CallInst &CI, const TargetTransformInfo &TTI) const {
+    if (const MemIntrinsic *MI = dyn_cast<MemIntrinsic>(&CI)) {
+        // Unoptimized codegen (clang marks every function optnone at -O0)
+        // calls libc even for small constant sizes
+        const ConstantInt *Len = dyn_cast<ConstantInt>(MI->getLength());
+        if (!Len || CI.getFunction()->hasOptNone()) {
+            return true;
+        }
+
+        uint64_t threshold = MemInlineThreshold.getNumOccurrences() ? MemInlineThreshold
+                                                                    : TTI.getMaxMemIntrinsicInlineSizeThreshold();
+        return Len->getZExtValue() > threshold;
+    }
 
-    nfaAcceptStates.insert(MEXIT);
+    switch (CI.getIntrinsicID()) {
+    // Single instructions on every target with an FPU
+    case Intrinsic::fabs:
+    case Intrinsic::sqrt:
+    case Intrinsic::copysign:
+        return false;
+    default:
+        return true;
+    }
+}
+
+CfgPassResult CfgPass::run(Module &M, ModuleAnalysisManager &AM) {
+    Result R;
 
     random_device rd;
     mt19937 gen(rd());
     uniform_int_distribution<int> distrib(100, 999);
 
-    int uid = distrib(gen);
+    bool libraryMode = !LibrarySummary.empty();
+    if (Hierarchical && (libraryMode || !SummaryFiles.empty())) {
+        errs() << "ERROR: Library summaries are not supported with -sandman-hierarchical.\n";
+        exit(1);
+    }
 
+    // A random base could collide with another library's, which only shows
+    // once a program links both
+    if (libraryMode && !IdBase.getNumOccurrences()) {
+        errs() << "ERROR: -sandman-library needs -sandman-id-base to give the library its own ids.\n";
+        exit(1);
+    }
+
+    // 0 restarts replays and RETURN_ID marks returns, neither may name a site
+    if (IdBase.getNumOccurrences() && IdBase <= (unsigned)RETURN_ID) {
+        errs() << "ERROR: -sandman-id-base must be above " << RETURN_ID << ", lower ids are reserved.\n";
+        exit(1);
+    }
+
+    // Ids of this module start above those of the libraries it calls into
+    LibrarySummaries summaries = loadLibrarySummaries();
+    int uidBase = IdBase.getNumOccurrences() ? (int)IdBase : distrib(gen);
+    if (uidBase <= summaries.maxId) {
+        if (IdBase.getNumOccurrences()) {
+            errs() << "ERROR: -sandman-id-base must be above " << summaries.maxId
+                   << ", the last input id of the library summaries.\n";
+            exit(1);
+        }
+        uidBase = summaries.maxId + 1;
+    }
+
+    FunctionAnalysisManager &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+    // Lib calls outside the policy are not checked and pass as epsilon
+    map<CallInst *, string> libCallNames;
+    set<CallInst *> ignoredCalls;
     for (Function &F : M) {
         if (F.isDeclaration()) {
             continue;
         }
 
-        BasicBlock &EntryBlock = F.getEntryBlock();
+        const TargetTransformInfo &TTI = FAM.getResult<TargetIRAnalysis>(F);
+        for (Instruction &I : instructions(F)) {
+            CallInst *CI = dyn_cast<CallInst>(&I);
+            if (!CI) {
+                continue;
+            }
 
-        for (Function::iterator BI = F.begin(), BE = F.end(); BI != BE; ++BI) {
-            BasicBlock *B = dyn_cast<BasicBlock>(&*BI);
-            string bbName = F.getName().str() + "-" + B->getName().str();
+            string funcName = libFnName(CI->getCalledFunction());
+            if (funcName.empty()) {
+                continue;
+            }
 
-            if (B->getName().str() == EntryBlock.getName().str()) {
-                bbName = F.getName().str() + "-" + ENTRY;
+            if (PreciseIntrinsics && CI->getCalledFunction()->isIntrinsic() && !lowersToLibCall(*CI, TTI)) {
+                continue;
             }
 
-            bool isItrmInserted = false;
-            int itrmCount = 1;
-            string uBbName = "";
-            string prevBb = bbName;
+            if (!isMonitored(funcName)) {
+                ignoredCalls.insert(CI);
+                continue;
+            }
 
-            for (Instruction &I : *B) {
-                if (isa<CallInst>(I)) {
-                    Function *CalledF = cast<CallInst>(I).getCalledFunction();
-                    string funcName = "";
+            libCallNames[CI] = funcName;
+        }
+    }
 
-                    if (CalledF->isIntrinsic()) {
-                        Intrinsic::ID id = CalledF->getIntrinsicID();
-                        StringRef baseName = Intrinsic::getBaseName(id);
-                        if (baseName.starts_with("llvm.")) {
-                            funcName = baseName.drop_front(5).str();
-                        } else {
-                            funcName = baseName.str();
-                        }
+    // In hierarchical mode only calls into functions that can reach a lib
+    // call need call/return symbols, the rest are invisible to the monitor
+    set<const Function *> monitoredFns;
+    if (Hierarchical) {
+        for (const auto &[CI, funcName] : libCallNames) {
+            monitoredFns.insert(CI->getFunction());
+        }
 
-                        if (!isLibFn(funcName)) {
-                            continue;
-                        }
-                    } else {
-                        funcName = CalledF->getName().str();
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (Function &F : M) {
+                if (F.isDeclaration() || monitoredFns.count(&F)) {
+                    continue;
+                }
+                for (Instruction &I : instructions(F)) {
+                    CallInst *CI = dyn_cast<CallInst>(&I);
+                    if (CI && CI->getCalledFunction() && monitoredFns.count(CI->getCalledFunction())) {
+                        monitoredFns.insert(&F);
+                        changed = true;
+                        break;
                     }
+                }
+            }
+        }
+    }
 
-                    if (isLibFn(funcName)) {
-                        // Handle transition for lib calls
-                        string transition = funcName + "(): " + to_string(uid);
-                        uBbName = bbName + "_i" + to_string(itrmCount);
-                        nfa[prevBb][transition].insert(uBbName);
-
-                        R.FoundLibCalls[dyn_cast<CallInst>(&I)] = uid;
-
-                        funcId[transition] = uid;
+    // State 0 must be main's entry, and the monitor keeps a single return
+    // stack per process
+    if (Hierarchical) {
+        Function *Main = M.getFunction("main");
+        if (!Main || Main->isDeclaration()) {
+            errs() << "ERROR: -sandman-hierarchical needs the module that defines main.\n";
+            exit(1);
+        }
+        for (const char *threadFn : {"pthread_create", "thrd_create", "clone", "clone3"}) {
+            if (M.getFunction(threadFn)) {
+                errs() << "ERROR: -sandman-hierarchical does not support threads, " << threadFn << " is used.\n";
+                exit(1);
+            }
+        }
+    }
 
-                        uid++;
-                        itrmCount++;
-                    } else {
-                        // Placeholder for non-lib functions
-                        string funcEntry = funcName + "-" + ENTRY;
-                        nfa[prevBb][EP].insert(funcEntry);
+    // Collect call sites up front so every id gets a stable site key
+    vector<pair<CallInst *, string>> sites;
+    for (Function &F : M) {
+        int siteCount = 0;
+        for (Instruction &I : instructions(F)) {
+            CallInst *CI = dyn_cast<CallInst>(&I);
+            if (!CI) {
+                continue;
+            }
 
-                        string funcExit = funcName + "-" + EXIT;
-                        if (CalledF->isDeclaration()) {
-                            nfa[funcEntry][EP].insert(funcExit);
-                        }
+            string siteKey = F.getName().str() + ":" + to_string(siteCount) + ":";
+            if (libCallNames.count(CI)) {
+                sites.push_back({CI, siteKey + libCallNames.at(CI)});
+                siteCount++;
+            } else if (CI->getCalledFunction() && monitoredFns.count(CI->getCalledFunction())) {
+                sites.push_back({CI, siteKey + "call:" + CI->getCalledFunction()->getName().str()});
+                siteCount++;
+            }
+        }
+    }
 
-                        uBbName = funcExit;
+    vector<Function *> definedFns;
+    vector<Function *> exports;
+    for (Function &F : M) {
+        if (!F.isDeclaration() && (!Hierarchical || monitoredFns.count(&F) || F.getName() == "main")) {
+            definedFns.push_back(&F);
+        }
+        if (libraryMode && !F.isDeclaration() && !F.hasLocalLinkage() && F.getName() != "main") {
+            exports.push_back(&F);
+        }
+    }
 
-                        // Intrinsic functions can be bypassed
-                        if (CalledF->isIntrinsic()) {
-                            nfa[prevBb][EP].insert(funcExit);
-                        }
-                    }
+    // Calls to declared functions with a summary enter it like a defined function
+    set<string> libraryExports;
+    vector<FunctionNfa> libraryFragments;
+    for (Function &F : M) {
+        auto it = summaries.exports.find(F.getName().str());
+        if (F.isDeclaration() && it != summaries.exports.end()) {
+            libraryExports.insert(it->first);
+            libraryFragments.push_back(exportNfa(it->first, it->second));
+        }
+    }
 
-                    prevBb = uBbName;
-                    isItrmInserted = true;
+    set<const Function *> summarized;
+    vector<pair<int, string>> idToSite;
+    vector<FunctionNfa> fragments(definedFns.size());
+    const map<CallInst *, int> *userCallIds = Hierarchical ? &R.FoundUserCalls : nullptr;
+
+    // Ids and fragments are rebuilt every round with the functions summarized
+    // so far. The order of their calls is lost anyway, so they share one id
+    // per callee.
+    auto buildFragments = [&] {
+        R.FoundLibCalls.clear();
+        R.FoundUserCalls.clear();
+        idToSite.clear();
+
+        map<pair<const Function *, string>, int> mergedIds;
+        int uid = uidBase;
+        for (const auto &site : sites) {
+            CallInst *CI = site.first;
+            int id = uid;
+            if (summarized.count(CI->getFunction())) {
+                string callee = libCallNames.count(CI) ? libCallNames.at(CI) : CI->getCalledFunction()->getName().str();
+                if (CI->isMustTailCall()) {
+                    callee = "tail:" + callee;
                 }
+                id = mergedIds.insert({{CI->getFunction(), callee}, uid}).first->second;
+            }
+            if (id == uid) {
+                uid++;
             }
 
-            if (successors(B).empty()) {
-                string uExit = F.getName().str() + "-" + EXIT;
-                if (isItrmInserted) {
-                    // epsilon transition to exit state from intermediate lib call in a block
-                    // uBbName -> last intermediate lib call
-                    nfa[uBbName][EP].insert(uExit);
-                } else {
-                    // epsilon transition to exit state from a block
-                    nfa[bbName][EP].insert(uExit);
-                }
-
-                Instruction *Terminator = B->getTerminator();
-                if (isa<UnreachableInst>(Terminator)) {
-                    nfaAcceptStates.insert(uExit);
-                }
+            if (libCallNames.count(CI)) {
+                R.FoundLibCalls[CI] = id;
             } else {
-                for (BasicBlock *Succ : successors(B)) {
-                    string uSuccName = F.getName().str() + "-" + Succ->getName().str();
-                    if (isItrmInserted) {
-                        // epsilon transition to successor blocks after intermediate lib call in a block
-                        // uBbName -> last intermediate lib call
-                        nfa[uBbName][EP].insert(uSuccName);
-                    } else {
-                        // epsilon transition to successor blocks from the block entry
-                        nfa[bbName][EP].insert(uSuccName);
-                    }
+                R.FoundUserCalls[CI] = id;
+            }
+            idToSite.push_back({id, site.second});
+        }
+
+        // Fragments are built concurrently and merged in module order, so the
+        // result does not depend on scheduling
+        vector<bool> summarize;
+        for (Function *F : definedFns) {
+            summarize.push_back(summarized.count(F));
+        }
+
+        if (NfaThreads != 1 && definedFns.size() > 1) {
+            DefaultThreadPool Pool(hardware_concurrency(NfaThreads));
+            for (size_t i = 0; i < definedFns.size(); i++) {
+                Pool.async([&, i] {
+                    fragments[i] = buildFunctionNfa(*definedFns[i], libCallNames, R.FoundLibCalls, ignoredCalls,
+                                                    libraryExports, userCallIds, summarize[i]);
+                });
+            }
+            Pool.wait();
+        } else {
+            for (size_t i = 0; i < definedFns.size(); i++) {
+                fragments[i] = buildFunctionNfa(*definedFns[i], libCallNames, R.FoundLibCalls, ignoredCalls,
+                                                libraryExports, userCallIds, summarize[i]);
+            }
+        }
+    };
+
+    // Whenever the budget runs out, the larger half of the functions that are
+    // not summarized yet is summarized and the round restarts
+    auto coarsen = [&] {
+        vector<size_t> candidates;
+        map<size_t, size_t> sizes;
+        for (size_t i = 0; i < definedFns.size(); i++) {
+            if (summarized.count(definedFns[i])) {
+                continue;
+            }
+            candidates.push_back(i);
+            for (const auto &[state, transitions] : fragments[i].nfa) {
+                for (const auto &[input, nextStates] : transitions) {
+                    sizes[i] += nextStates.size();
                 }
             }
+        }
+        if (candidates.empty()) {
+            return false;
+        }
 
-        } // end Function:iterator loop
+        stable_sort(candidates.begin(), candidates.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+        candidates.resize((candidates.size() + 1) / 2);
+        for (size_t i : candidates) {
+            summarized.insert(definedFns[i]);
+        }
+        return true;
+    };
+
+    map<string, int> funcId;
+    MinNfaResult minNfa;
+    map<const Function *, MinNfaResult> dfas;
+    map<string, ExportSummary> exportSummaries;
+    bool sizeBounded = MaxStates || MaxTransitions;
+    bool timeBounded = MaxSeconds > 0;
+    while (true) {
+        buildFragments();
+
+        DeterminizeBudget budget;
+        if (sizeBounded) {
+            budget.maxStates = MaxStates;
+            budget.maxTransitions = MaxTransitions;
+        }
+        // Every round gets the whole time limit, so a round with more
+        // functions summarized is not cut short by the ones before it
+        if (timeBounded) {
+            budget.deadline = chrono::steady_clock::now() + chrono::seconds(MaxSeconds);
+        }
+
+        DeterminizeBudget *roundBudget = sizeBounded || timeBounded ? &budget : nullptr;
+        bool complete;
+        if (Hierarchical) {
+            complete = determinizeFunctions(definedFns, fragments, dfas, roundBudget);
+        } else if (libraryMode) {
+            complete = determinizeExports(exports, fragments, libraryFragments, exportSummaries, roundBudget);
+        } else {
+            minNfa = determinizeModule(fragments, libraryFragments, funcId, roundBudget);
+            complete = minNfa.complete;
+        }
+        if (complete) {
+            break;
+        }
+
+        if (coarsen()) {
+            continue;
+        }
+        errs() << "WARNING: Policy exceeds the budget with every function summarized.\n";
+        sizeBounded = false;
+        timeBounded = false;
     }
 
-    // Post processing to remove transition from accepting states
-    for (const string &acceptState : nfaAcceptStates) {
-        if (nfa.count(acceptState)) {
-            nfa.erase(acceptState);
+    generateCoarseningReport(definedFns, summarized);
+
+    // The ids of a library are fixed once it is built, so they are not merged
+    if (libraryMode) {
+        generateLibrarySummary(LibrarySummary, exportSummaries, idToSite);
+        return R;
+    }
+
+    vector<DatRule> rules;
+    if (Hierarchical) {
+        rules = buildHierarchicalRules(definedFns, fragments, dfas, R.FoundUserCalls);
+    } else {
+        generateNfaDot(minNfa);
+        rules = buildDatRules(minNfa, funcId);
+    }
+
+    if (MergeIds) {
+        map<int, int> sharedId = mergeEquivalentIds(rules, idToSite);
+        for (auto &[CI, id] : R.FoundLibCalls) {
+            id = sharedId.at(id);
+        }
+        for (auto &[CI, id] : R.FoundUserCalls) {
+            id = sharedId.at(id);
+        }
+        for (auto &[id, site] : idToSite) {
+            id = sharedId.at(id);
         }
     }
 
-    MinNfaResult minNfa = convertNfaToMinNfa(nfa, MENTRY, nfaAcceptStates);
-    generateNfaDot(minNfa);
-    generateDatFiles(minNfa, funcId);
+    generateDatFiles(rules);
+    idToSite.insert(idToSite.end(), summaries.idToSite.begin(), summaries.idToSite.end());
+    generateSitesFile(idToSite);
 
     return R;
 };
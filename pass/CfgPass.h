@@ -1,14 +1,21 @@
 #ifndef CFG_PASS_H
 #define CFG_PASS_H
 
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include <map>
 #include <unordered_set>
 
+// Input id the monitor pops its return stack on (hierarchical mode)
+const int RETURN_ID = 1;
+
 class CfgPassResult {
   public:
     std::map<llvm::CallInst *, int> FoundLibCalls;
+    // Calls that are checked on entry and on return (hierarchical mode)
+    std::map<llvm::CallInst *, int> FoundUserCalls;
 };
 
 struct CfgPass : public llvm::AnalysisInfoMixin<CfgPass> {
@@ -18,7 +25,12 @@ struct CfgPass : public llvm::AnalysisInfoMixin<CfgPass> {
 
   private:
     std::unordered_set<std::string> FnsList;
+    // Lib functions that become transitions, empty to monitor all of them
+    std::unordered_set<std::string> MonitoredFns;
     bool isLibFn(const std::string &nameToFind) const;
+    bool isMonitored(const std::string &funcName) const;
+    std::string libFnName(const llvm::Function *CalledF) const;
+    bool lowersToLibCall(const llvm::CallInst &CI, const llvm::TargetTransformInfo &TTI) const;
 
   public:
     CfgPass();
@@ -11,7 +11,7 @@ const int64_t DUMMY_ID = 462;
 PreservedAnalyses DummyPass::run(Module &M, ModuleAnalysisManager &AM) {
     const CfgPassResult &Result = AM.getResult<CfgPass>(M);
 
-    if (Result.FoundLibCalls.empty()) {
+    if (Result.FoundLibCalls.empty() && Result.FoundUserCalls.empty()) {
         return PreservedAnalyses::all();
     }
 
@@ -26,13 +26,30 @@ PreservedAnalyses DummyPass::run(Module &M, ModuleAnalysisManager &AM) {
 
     IRBuilder<> Builder(Ctx);
 
-    for (auto const &[CI, id] : Result.FoundLibCalls) {
-        Builder.SetInsertPoint(CI);
+    auto insertCheck = [&](Instruction *Before, int id) {
+        Builder.SetInsertPoint(Before);
         Value *SyscallNum = ConstantInt::get(Int64Ty, DUMMY_ID);
         Value *idVal = ConstantInt::get(Int32Ty, id);
         Value *idVal64 = Builder.CreateZExt(idVal, Int64Ty);
         Builder.CreateCall(SyscallFunc, {SyscallNum, idVal64});
+    };
+
+    for (auto const &[CI, id] : Result.FoundLibCalls) {
+        insertCheck(CI, id);
+    }
+
+    // Calls into monitored functions are checked on entry and on return.
+    // Nothing may follow a musttail call, its callee returns for the caller.
+    for (auto const &[CI, id] : Result.FoundUserCalls) {
+        insertCheck(CI, id);
+        if (!CI->isMustTailCall()) {
+            insertCheck(CI->getNextNode(), RETURN_ID);
+        }
     }
 
-    return PreservedAnalyses::none();
+    // Only calls were inserted, the CFG of every function is unchanged
+    PreservedAnalyses PA;
+    PA.preserve<FunctionAnalysisManagerModuleProxy>();
+    PA.preserveSet<CFGAnalyses>();
+    return PA;
 }
@@ -0,0 +1,221 @@
+#include "OverheadReport.h"
+#include "CfgPass.h"
+
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/JSON.h"
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<unsigned> CheckCostNs(
+    "sandman-check-cost-ns",
+    cl::desc("Cost of one check in nanoseconds used to project overhead (see monitor-bench)"),
+    cl::init(250));
+
+const size_t HOTTEST_SITES = 20;
+
+struct SiteEstimate {
+    CallInst *CI;
+    int id;
+    // Checks made each time the site runs: one, or two for a call with a return check
+    unsigned checks;
+    double checksPerCall;
+    double checksPerRun;
+    unsigned loopDepth;
+};
+
+struct FunctionEstimate {
+    Function *F;
+    size_t sites;
+    double callsPerRun;
+    double checksPerCall;
+    double instructionsPerCall;
+};
+
+static string calleeName(const CallInst *CI) {
+    return CI->getCalledOperand()->stripPointerCasts()->getName().str();
+}
+
+static string location(const CallInst *CI) {
+    const DILocation *Loc = CI->getDebugLoc().get();
+    if (!Loc) {
+        return "";
+    }
+    return Loc->getFilename().str() + ":" + to_string(Loc->getLine());
+}
+
+// How often BB runs per invocation of its function
+static double perCall(FunctionAnalysisManager &FAM, const BasicBlock *BB) {
+    Function &F = *const_cast<Function *>(BB->getParent());
+    BlockFrequencyInfo &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+    double entryFreq = max<uint64_t>(BFI.getBlockFreq(&F.getEntryBlock()).getFrequency(), 1);
+    return BFI.getBlockFreq(BB).getFrequency() / entryFreq;
+}
+
+static Function *definedCallee(Instruction &I) {
+    auto *CI = dyn_cast<CallInst>(&I);
+    Function *Callee = CI ? CI->getCalledFunction() : nullptr;
+    return Callee && !Callee->isDeclaration() ? Callee : nullptr;
+}
+
+// Invocations of every defined function per run of main, through direct
+// calls. Functions not reached from main (callbacks, or a module without
+// main) are counted as invoked once. Recursive calls are not followed.
+static map<const Function *, double> estimateInvocations(Module &M, FunctionAnalysisManager &FAM) {
+    vector<Function *> postOrder;
+    set<Function *> visited;
+    function<void(Function *)> visit = [&](Function *F) {
+        if (!visited.insert(F).second) {
+            return;
+        }
+        for (Instruction &I : instructions(*F)) {
+            if (Function *Callee = definedCallee(I)) {
+                visit(Callee);
+            }
+        }
+        postOrder.push_back(F);
+    };
+
+    map<const Function *, double> invocations;
+    vector<Function *> roots;
+    if (Function *Main = M.getFunction("main"); Main && !Main->isDeclaration()) {
+        roots.push_back(Main);
+    }
+    for (Function &F : M) {
+        if (!F.isDeclaration()) {
+            roots.push_back(&F);
+        }
+    }
+    for (Function *F : roots) {
+        if (!visited.count(F)) {
+            invocations[F] = 1;
+            visit(F);
+        }
+    }
+
+    // Callers come before their callees, except on recursive calls
+    map<const Function *, size_t> position;
+    for (size_t i = 0; i < postOrder.size(); i++) {
+        position[postOrder[postOrder.size() - 1 - i]] = i;
+    }
+    for (auto it = postOrder.rbegin(); it != postOrder.rend(); ++it) {
+        Function *F = *it;
+        for (Instruction &I : instructions(*F)) {
+            Function *Callee = definedCallee(I);
+            if (Callee && position[Callee] > position[F]) {
+                invocations[Callee] += invocations[F] * perCall(FAM, I.getParent());
+            }
+        }
+    }
+
+    return invocations;
+}
+
+PreservedAnalyses OverheadReport::run(Module &M, ModuleAnalysisManager &AM) {
+    const CfgPassResult &Result = AM.getResult<CfgPass>(M);
+    FunctionAnalysisManager &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+    map<const Function *, double> invocations = estimateInvocations(M, FAM);
+
+    vector<FunctionEstimate> fns;
+    vector<SiteEstimate> allSites;
+    double checksPerRun = 0;
+    for (Function &F : M) {
+        // In program order so that ties are reported the same way every build
+        vector<SiteEstimate> sites;
+        for (Instruction &I : instructions(F)) {
+            auto *CI = dyn_cast<CallInst>(&I);
+            if (!CI) {
+                continue;
+            }
+            if (auto it = Result.FoundLibCalls.find(CI); it != Result.FoundLibCalls.end()) {
+                sites.push_back({CI, it->second, 1, 0, 0, 0});
+            } else if (auto it = Result.FoundUserCalls.find(CI); it != Result.FoundUserCalls.end()) {
+                sites.push_back({CI, it->second, CI->isMustTailCall() ? 1u : 2u, 0, 0, 0});
+            }
+        }
+        if (sites.empty()) {
+            continue;
+        }
+
+        LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+
+        FunctionEstimate estimate = {&F, sites.size(), invocations[&F], 0, 0};
+        for (const BasicBlock &BB : F) {
+            estimate.instructionsPerCall += perCall(FAM, &BB) * BB.size();
+        }
+        for (SiteEstimate &site : sites) {
+            BasicBlock *BB = site.CI->getParent();
+            site.checksPerCall = site.checks * perCall(FAM, BB);
+            site.checksPerRun = site.checksPerCall * estimate.callsPerRun;
+            site.loopDepth = LI.getLoopDepth(BB);
+            estimate.checksPerCall += site.checksPerCall;
+            allSites.push_back(site);
+        }
+        checksPerRun += estimate.checksPerCall * estimate.callsPerRun;
+        fns.push_back(estimate);
+    }
+
+    auto perRun = [](const FunctionEstimate &e) { return e.checksPerCall * e.callsPerRun; };
+    stable_sort(fns.begin(), fns.end(),
+                [&](const FunctionEstimate &a, const FunctionEstimate &b) { return perRun(a) > perRun(b); });
+    stable_sort(allSites.begin(), allSites.end(),
+                [](const SiteEstimate &a, const SiteEstimate &b) { return a.checksPerRun > b.checksPerRun; });
+    if (allSites.size() > HOTTEST_SITES) {
+        allSites.resize(HOTTEST_SITES);
+    }
+
+    error_code EC;
+    raw_fd_ostream ReportFile("nfa-overhead.json", EC);
+
+    if (EC) {
+        errs() << "Error opening nfa-overhead.json: " << EC.message() << "\n";
+        return PreservedAnalyses::all();
+    }
+
+    json::OStream J(ReportFile, 2);
+    J.object([&] {
+        J.attribute("check_cost_ns", (int64_t)CheckCostNs);
+        J.attribute("checks_per_run", checksPerRun);
+        J.attribute("projected_ns_per_run", checksPerRun * CheckCostNs);
+        J.attributeArray("functions", [&] {
+            for (const FunctionEstimate &estimate : fns) {
+                J.object([&] {
+                    J.attribute("name", estimate.F->getName());
+                    J.attribute("sites", (int64_t)estimate.sites);
+                    J.attribute("calls_per_run", estimate.callsPerRun);
+                    J.attribute("checks_per_call", estimate.checksPerCall);
+                    J.attribute("instructions_per_call", estimate.instructionsPerCall);
+                    J.attribute("projected_ns_per_call", estimate.checksPerCall * CheckCostNs);
+                    J.attribute("projected_ns_per_run", perRun(estimate) * CheckCostNs);
+                });
+            }
+        });
+        J.attributeArray("hottest_sites", [&] {
+            for (const SiteEstimate &site : allSites) {
+                J.object([&] {
+                    J.attribute("function", site.CI->getFunction()->getName());
+                    J.attribute("callee", calleeName(site.CI));
+                    J.attribute("id", site.id);
+                    J.attribute("location", location(site.CI));
+                    J.attribute("loop_depth", (int64_t)site.loopDepth);
+                    J.attribute("checks_per_call", site.checksPerCall);
+                    J.attribute("checks_per_run", site.checksPerRun);
+                });
+            }
+        });
+    });
+    ReportFile << "\n";
+
+    return PreservedAnalyses::all();
+}
@@ -0,0 +1,12 @@
+#ifndef OVERHEAD_REPORT_H
+#define OVERHEAD_REPORT_H
+
+#include "llvm/IR/PassManager.h"
+
+// Estimates where the checks inserted by DummyPass will cost the most, from
+// static block frequencies, and writes it to nfa-overhead.json.
+struct OverheadReport : public llvm::PassInfoMixin<OverheadReport> {
+    llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+};
+
+#endif
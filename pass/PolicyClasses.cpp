@@ -0,0 +1,50 @@
+#include "PolicyClasses.h"
+
+#include <map>
+#include <vector>
+
+using namespace std;
+
+// Security relevant libc entry points, grouped by what they give access to.
+// Pure helpers such as strlen or toupper are deliberately in no class.
+static const map<string, vector<string>> PolicyClasses = {
+    {"file",
+     {"open", "open64", "openat", "openat64", "creat", "creat64", "fopen", "fopen64", "freopen", "freopen64",
+      "fdopen", "close", "fclose", "read", "pread", "pread64", "readv", "preadv", "write", "pwrite", "pwrite64",
+      "writev", "pwritev", "fread", "fwrite", "fgets", "fputs", "fgetc", "fputc", "getc", "putc", "fprintf",
+      "vfprintf", "fscanf", "vfscanf", "lseek", "lseek64", "fseek", "fseeko", "ftell", "truncate", "ftruncate",
+      "unlink", "unlinkat", "remove", "rename", "renameat", "renameat2", "mkdir", "mkdirat", "rmdir", "chmod",
+      "fchmod", "fchmodat", "chown", "fchown", "lchown", "fchownat", "link", "linkat", "symlink", "symlinkat",
+      "readlink", "readlinkat", "stat", "stat64", "fstat", "fstat64", "lstat", "lstat64", "fstatat", "statx",
+      "access", "faccessat", "opendir", "fdopendir", "readdir", "readdir64", "closedir", "dup", "dup2", "dup3",
+      "fcntl", "ioctl", "flock", "fsync", "fdatasync", "chdir", "fchdir", "chroot", "mount", "umount", "umount2",
+      "tmpfile", "mkstemp", "mkostemp", "mkdtemp", "sendfile", "splice", "pipe", "pipe2", "mkfifo", "mknod"}},
+    {"network",
+     {"socket", "socketpair", "bind", "listen", "accept", "accept4", "connect", "send", "sendto", "sendmsg",
+      "sendmmsg", "recv", "recvfrom", "recvmsg", "recvmmsg", "shutdown", "getsockopt", "setsockopt",
+      "getsockname", "getpeername", "getaddrinfo", "getnameinfo", "gethostbyname", "gethostbyname2",
+      "gethostbyaddr", "select", "pselect", "poll", "ppoll", "epoll_create", "epoll_create1", "epoll_ctl",
+      "epoll_wait", "epoll_pwait"}},
+    {"process",
+     {"fork", "vfork", "clone", "execve", "execv", "execvp", "execvpe", "execl", "execlp", "execle", "fexecve",
+      "system", "popen", "pclose", "posix_spawn", "posix_spawnp", "wait", "waitpid", "waitid", "wait3", "wait4",
+      "kill", "raise", "abort", "exit", "_exit", "_Exit", "quick_exit", "setuid", "setgid", "seteuid", "setegid",
+      "setreuid", "setregid", "setresuid", "setresgid", "setgroups", "initgroups", "setsid", "setpgid", "prctl",
+      "ptrace", "nice", "setpriority", "setrlimit", "prlimit", "sched_setaffinity", "sched_setscheduler",
+      "signal", "sigaction", "daemon", "dlopen", "dlsym", "unshare", "setns", "pthread_create"}},
+    {"memory",
+     {"malloc", "calloc", "realloc", "reallocarray", "free", "posix_memalign", "aligned_alloc", "memalign",
+      "valloc", "pvalloc", "mmap", "mmap64", "munmap", "mremap", "mprotect", "pkey_mprotect", "madvise", "mlock",
+      "mlock2", "munlock", "mlockall", "munlockall", "brk", "sbrk", "shm_open", "shm_unlink", "shmget", "shmat",
+      "shmdt", "shmctl", "memfd_create"}},
+};
+
+bool addPolicyClass(const string &name, unordered_set<string> &fns) {
+    auto it = PolicyClasses.find(name);
+    if (it == PolicyClasses.end()) {
+        return false;
+    }
+
+    fns.insert(it->second.begin(), it->second.end());
+    return true;
+}
@@ -0,0 +1,11 @@
+#ifndef POLICY_CLASSES_H
+#define POLICY_CLASSES_H
+
+#include <string>
+#include <unordered_set>
+
+// Adds the libc functions of a policy class (file, network, process or
+// memory) to fns. Returns false if there is no class of that name.
+bool addPolicyClass(const std::string &name, std::unordered_set<std::string> &fns);
+
+#endif
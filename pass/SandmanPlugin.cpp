@@ -1,11 +1,32 @@
 #include "CfgPass.h"
 #include "DummyPass.h"
+#include "OverheadReport.h"
 
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
 
 using namespace llvm;
 
+static cl::opt<bool> LateInstrumentation(
+    "sandman-late",
+    cl::desc("Analyze and instrument the final call set after optimization instead of at pipeline start"),
+    cl::init(false));
+
+static cl::opt<bool> OverheadReportOpt(
+    "sandman-overhead-report",
+    cl::desc("Write the estimated cost of the inserted checks to nfa-overhead.json"),
+    cl::init(false));
+
+// The report reads the analysis the checks are inserted from, so it runs just before
+static void addInstrumentation(ModulePassManager &MPM) {
+    if (OverheadReportOpt) {
+        MPM.addPass(OverheadReport());
+    }
+    MPM.addPass(DummyPass());
+}
+
 extern "C" LLVM_ATTRIBUTE_WEAK ::PassPluginLibraryInfo
 llvmGetPassPluginInfo() {
     return {
@@ -17,7 +38,31 @@ llvmGetPassPluginInfo() {
                 [](ModuleAnalysisManager &MAM) { MAM.registerPass([&] { return CfgPass(); }); });
 
             PB.registerPipelineStartEPCallback(
-                [](ModulePassManager &MPM, OptimizationLevel Level) { MPM.addPass(DummyPass()); });
+                [](ModulePassManager &MPM, OptimizationLevel Level) {
+                    if (!LateInstrumentation) {
+                        addInstrumentation(MPM);
+                    }
+                });
+
+            // LTO pre-link modules are only part of the program, they are
+            // instrumented as a whole at link time instead. ThinLTO never
+            // sees the whole program, so it would build without any checks.
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel Level, ThinOrFullLTOPhase Phase) {
+                    if (LateInstrumentation && Phase == ThinOrFullLTOPhase::ThinLTOPreLink) {
+                        report_fatal_error("-sandman-late does not support ThinLTO, use -flto=full", false);
+                    }
+                    if (LateInstrumentation && Phase == ThinOrFullLTOPhase::None) {
+                        addInstrumentation(MPM);
+                    }
+                });
+
+            PB.registerFullLinkTimeOptimizationLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel Level) {
+                    if (LateInstrumentation) {
+                        addInstrumentation(MPM);
+                    }
+                });
         },
     };
 }
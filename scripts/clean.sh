@@ -5,9 +5,14 @@ rm -rf ./.cache
 
 rm -f nfa.dat
 rm -f nfa.dot
+rm -f nfa.sites
+rm -f nfa.coarsened
+rm -f nfa-overhead.json
 rm -f final-build.out
 
 rm -f ./loader/vmlinux.h
 rm -f ./loader/monitor.o
 rm -f ./loader/monitor.skel.h
 rm -f ebpf-loader
+rm -f monitor-bench
+rm -f monitor-replay
@@ -11,12 +11,13 @@ PASS_PLUGIN="./build/pass/SandmanPlugin.so"
 # 1. Check if an argument was provided
 if [ $# -eq 0 ]; then
     echo "Error: No C file specified."
-    echo "Usage: $0 path/to/yourfile.c"
+    echo "Usage: $0 path/to/yourfile.c [clang options...]"
     exit 1
 fi
 
 # 2. Get the C file path from the first argument
 SOURCE_FILE="$1"
+shift
 
 # 3. Check if the C file actually exists
 if [ ! -f "$SOURCE_FILE" ]; then
@@ -34,4 +35,5 @@ fi
 OUTPUT_FILE="${SOURCE_FILE%.c}.out"
 
 # 6. Run the compile command with the variables
-clang -fpass-plugin="$PASS_PLUGIN" "$SOURCE_FILE" -o "$OUTPUT_FILE"
+# -fplugin loads the plugin early so its -mllvm options are recognized
+clang -fplugin="$PASS_PLUGIN" -fpass-plugin="$PASS_PLUGIN" "$@" "$SOURCE_FILE" -o "$OUTPUT_FILE"
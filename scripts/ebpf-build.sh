@@ -1,10 +1,14 @@
 #!/bin/bash
 set -e
 
+ARCH=$(uname -m | sed -e 's/x86_64/x86/' -e 's/aarch64/arm64/')
+
 bpftool btf dump file /sys/kernel/btf/vmlinux format c > ./loader/vmlinux.h
-clang -g -O2 -target bpf -c ./loader/monitor.c -o ./loader/monitor.o
+clang -g -O2 -target bpf -D__TARGET_ARCH_$ARCH -c ./loader/monitor.c -o ./loader/monitor.o
 bpftool gen skeleton ./loader/monitor.o > ./loader/monitor.skel.h
 clang ./loader/loader.c -o ebpf-loader -lbpf -lelf
+clang ./loader/bench.c -o monitor-bench -lbpf -lelf
+clang ./loader/replay.c -o monitor-replay -lbpf -lelf
 
 rm ./loader/vmlinux.h
 rm ./loader/monitor.o
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# Exit immediately if any command fails
+set -e
+
+PASS_PLUGIN="./build/pass/SandmanPlugin.so"
+
+if [ $# -lt 2 ]; then
+    echo "Error: No library name or C files specified."
+    echo "Usage: $0 <name> file1.c file2.c ... [-- options for the instrumented build...]"
+    echo "Set CFLAGS for the C files, e.g. include directories."
+    exit 1
+fi
+
+if [ ! -f "$PASS_PLUGIN" ]; then
+    echo "Error: Pass plugin not found at $PASS_PLUGIN"
+    echo "Did you build your pass?"
+    exit 1
+fi
+
+LIB_NAME="$1"
+shift
+
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    source_file="$1"
+    shift
+
+    if [ ! -f "$source_file" ]; then
+        echo "Warning: File not found, skipping: $source_file"
+        continue
+    fi
+
+    output_bc="${source_file%.c}.bc"
+
+    clang $CFLAGS -emit-llvm -c "$source_file" -o "$output_bc"
+
+    bitcode_files+=("$output_bc")
+done
+
+if [ "$1" == "--" ]; then
+    shift
+fi
+
+if [ ${#bitcode_files[@]} -eq 0 ]; then
+    echo "Error: No valid C files were compiled."
+    exit 1
+fi
+
+# The library is analyzed as one module, so calls between its files are followed
+llvm-link "${bitcode_files[@]}" -o combined.bc
+
+clang -fplugin="$PASS_PLUGIN" -fpass-plugin="$PASS_PLUGIN" -mllvm -sandman-library="lib$LIB_NAME.sandman" "$@" \
+    -c combined.bc -o "lib$LIB_NAME.o"
+rm -f "lib$LIB_NAME.a"
+ar rcs "lib$LIB_NAME.a" "lib$LIB_NAME.o"
+
+rm "${bitcode_files[@]}" combined.bc "lib$LIB_NAME.o"
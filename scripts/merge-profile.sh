@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Exit immediately if any command fails
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Error: Missing arguments."
+    echo "Usage: $0 <profile.raw>... <nfa.sites> > sandman.profdata"
+    exit 1
+fi
+
+SITES_FILE="${@: -1}"
+RAW_FILES=("${@:1:$#-1}")
+
+if [ ! -f "$SITES_FILE" ]; then
+    echo "Error: Sites file not found: $SITES_FILE" >&2
+    exit 1
+fi
+
+# Raw profiles hold "<state> <input-id> <hits>" per transition. Sum the hits of
+# every input id over all states and runs, then key them by call site. Sites
+# of a summarized function share an id and all get its hits.
+awk '
+    FNR == NR { sites[$1] = ($1 in sites) ? sites[$1] " " $2 : $2; next }
+    { hits[$2] += $3 }
+    END {
+        for (id in hits) {
+            if (id in sites) {
+                n = split(sites[id], list, " ")
+                for (i = 1; i <= n; i++) {
+                    print list[i], hits[id]
+                }
+            }
+        }
+    }
+' "$SITES_FILE" "${RAW_FILES[@]}" | sort -k2,2nr
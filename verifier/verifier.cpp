@@ -0,0 +1,499 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <queue>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Interleaving several traces per worker keeps multiple independent table
+// lookups in flight, so a cache miss on one trace does not stall the others.
+const int LANES = 8;
+const size_t CHUNK = 64;
+const uint32_t MAX_INPUT_ID = 1u << 24;
+
+const int32_t NO_TRANSITION = -1;
+const uint32_t STATE_FINAL = 69420;
+
+// Hierarchical policies, see the monitor
+const uint32_t RETURN_ID = 1;
+const uint32_t NO_PUSH = 0xFFFFFFFF;
+const uint32_t MAX_CALL_DEPTH = 64;
+
+enum Violation : uint8_t {
+    NONE = 0,
+    INVALID_TRANSITION,
+    AFTER_FINAL,
+    UNKNOWN_INPUT,
+    RETURN_WITHOUT_CALL,
+    CALL_DEPTH_EXCEEDED,
+};
+
+const char *violationName(Violation v) {
+    switch (v) {
+    case INVALID_TRANSITION:
+        return "invalid transition";
+    case AFTER_FINAL:
+        return "transition after final state";
+    case UNKNOWN_INPUT:
+        return "unknown input id";
+    case RETURN_WITHOUT_CALL:
+        return "return without call";
+    case CALL_DEPTH_EXCEEDED:
+        return "call depth exceeded";
+    default:
+        return "none";
+    }
+}
+
+// Dense transition table built from nfa.dat. States are renumbered into rows
+// in breadth-first order from the start state and input ids into columns, so
+// a step is one array index instead of a hash lookup. The last row stands for
+// the monitor's STATE_FINAL and has no outgoing transitions. push holds the
+// row to resume in after a call returns and is empty for flat policies.
+struct DenseTable {
+    vector<int32_t> next;
+    vector<int32_t> push;
+    vector<int32_t> colOf;
+    vector<uint32_t> stateOfRow;
+    uint32_t cols = 0;
+    int32_t startRow = 0;
+    int32_t finalRow = 0;
+};
+
+struct Rule {
+    uint32_t cur;
+    uint32_t input;
+    uint32_t next;
+    uint32_t isFinal;
+    uint32_t push;
+};
+
+bool loadTable(const char *path, DenseTable &T) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "ERROR: Failed to open dat file: %s\n", strerror(errno));
+        return false;
+    }
+
+    vector<Rule> rules;
+    char line[256];
+    int lineNum = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineNum++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        Rule r;
+        r.push = NO_PUSH;
+        int ret = sscanf(line, "%u %u %u %u %u", &r.cur, &r.input, &r.next, &r.isFinal, &r.push);
+        if (ret != 4 && ret != 5) {
+            fprintf(stderr, "Warning: Skipping malformed line %d: %s", lineNum, line);
+            continue;
+        }
+        if (r.input >= MAX_INPUT_ID) {
+            fprintf(stderr, "ERROR: Input id %u on line %d is too large\n", r.input, lineNum);
+            fclose(f);
+            return false;
+        }
+        rules.push_back(r);
+    }
+    fclose(f);
+
+    unordered_map<uint32_t, vector<const Rule *>> out;
+    uint32_t maxInput = 0;
+    bool hasCalls = false;
+    for (const Rule &r : rules) {
+        out[r.cur].push_back(&r);
+        maxInput = max(maxInput, r.input);
+        hasCalls |= r.push != NO_PUSH;
+    }
+
+    T.colOf.assign(maxInput + 1, NO_TRANSITION);
+    for (const Rule &r : rules) {
+        if (T.colOf[r.input] == NO_TRANSITION) {
+            T.colOf[r.input] = T.cols++;
+        }
+    }
+
+    unordered_map<uint32_t, int32_t> rowOf;
+    queue<uint32_t> q;
+    rowOf[0] = 0;
+    T.stateOfRow.push_back(0);
+    q.push(0);
+    while (!q.empty()) {
+        uint32_t s = q.front();
+        q.pop();
+        for (const Rule *r : out[s]) {
+            for (uint32_t target : {r->isFinal ? NO_PUSH : r->next, r->push}) {
+                if (target != NO_PUSH && rowOf.emplace(target, T.stateOfRow.size()).second) {
+                    T.stateOfRow.push_back(target);
+                    q.push(target);
+                }
+            }
+        }
+    }
+
+    T.startRow = 0;
+    T.finalRow = T.stateOfRow.size();
+    T.next.assign((size_t)(T.finalRow + 1) * max(T.cols, 1u), NO_TRANSITION);
+    if (hasCalls) {
+        T.push.assign(T.next.size(), NO_TRANSITION);
+    }
+    for (const Rule &r : rules) {
+        auto curIt = rowOf.find(r.cur);
+        if (curIt == rowOf.end()) {
+            continue; // unreachable from the start state
+        }
+        size_t idx = (size_t)curIt->second * T.cols + T.colOf[r.input];
+        T.next[idx] = r.isFinal ? T.finalRow : rowOf.at(r.next);
+        if (r.push != NO_PUSH) {
+            T.push[idx] = rowOf.at(r.push);
+        }
+    }
+
+    printf("VERIFIER: Loaded %zu rules, %d states, %u inputs from %s\n", rules.size(), T.finalRow, T.cols, path);
+    return true;
+}
+
+struct MappedFile {
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+};
+
+bool mapFile(const char *path, MappedFile &M) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Failed to open trace file %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "ERROR: Failed to stat trace file %s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    M.size = st.st_size;
+    if (M.size > 0) {
+        void *p = mmap(nullptr, M.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "ERROR: Failed to map trace file %s: %s\n", path, strerror(errno));
+            close(fd);
+            return false;
+        }
+        madvise(p, M.size, MADV_SEQUENTIAL);
+        M.data = static_cast<const uint8_t *>(p);
+    }
+    close(fd);
+    return true;
+}
+
+// A trace is a span of events inside one mapped file. Binary traces are
+// stored as a little-endian u32 event count followed by that many u32 input
+// ids; text traces are one line of whitespace separated ids.
+struct Trace {
+    const uint8_t *begin;
+    const uint8_t *end;
+};
+
+bool indexBinary(const MappedFile &M, const char *path, vector<Trace> &traces) {
+    size_t off = 0;
+    while (off < M.size) {
+        uint32_t count;
+        if (M.size - off < sizeof(count)) {
+            fprintf(stderr, "ERROR: Truncated trace header in %s at offset %zu\n", path, off);
+            return false;
+        }
+        memcpy(&count, M.data + off, sizeof(count));
+        off += sizeof(count);
+
+        size_t bytes = (size_t)count * sizeof(uint32_t);
+        if (M.size - off < bytes) {
+            fprintf(stderr, "ERROR: Truncated trace in %s at offset %zu\n", path, off);
+            return false;
+        }
+        traces.push_back({M.data + off, M.data + off + bytes});
+        off += bytes;
+    }
+    return true;
+}
+
+void indexText(const MappedFile &M, vector<Trace> &traces) {
+    const uint8_t *p = M.data;
+    const uint8_t *end = M.data + M.size;
+    while (p < end) {
+        const uint8_t *nl = static_cast<const uint8_t *>(memchr(p, '\n', end - p));
+        const uint8_t *lineEnd = nl ? nl : end;
+        if (lineEnd != p && *p != '#') {
+            traces.push_back({p, lineEnd});
+        }
+        p = lineEnd + 1;
+    }
+}
+
+struct BinaryCursor {
+    const uint8_t *p;
+    const uint8_t *end;
+
+    bool next(uint32_t &id) {
+        if (p == end) {
+            return false;
+        }
+        memcpy(&id, p, sizeof(id));
+        p += sizeof(id);
+        return true;
+    }
+};
+
+struct TextCursor {
+    const uint8_t *p;
+    const uint8_t *end;
+
+    bool next(uint32_t &id) {
+        while (p != end && (*p < '0' || *p > '9')) {
+            p++;
+        }
+        if (p == end) {
+            return false;
+        }
+        uint64_t v = 0;
+        while (p != end && *p >= '0' && *p <= '9') {
+            v = v * 10 + (*p++ - '0');
+        }
+        id = v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+        return true;
+    }
+};
+
+struct TraceResult {
+    uint64_t events = 0;
+    uint64_t violationEvent = 0;
+    uint32_t input = 0;
+    uint32_t state = 0;
+    Violation violation = NONE;
+};
+
+template <typename Cursor>
+void verifyWorker(const DenseTable &T, const vector<Trace> &traces, vector<TraceResult> &results,
+                  atomic<size_t> &nextChunk) {
+    struct Lane {
+        Cursor cur;
+        size_t trace;
+        int32_t row;
+        uint64_t events;
+        uint32_t depth;
+        int32_t stack[MAX_CALL_DEPTH];
+        bool active = false;
+    };
+
+    Lane lanes[LANES];
+    size_t chunkPos = 0, chunkEnd = 0;
+
+    auto refill = [&](Lane &L) {
+        if (chunkPos == chunkEnd) {
+            chunkPos = nextChunk.fetch_add(CHUNK);
+            chunkEnd = min(chunkPos + CHUNK, traces.size());
+            if (chunkPos >= chunkEnd) {
+                chunkPos = chunkEnd;
+                L.active = false;
+                return;
+            }
+        }
+        L.trace = chunkPos++;
+        L.cur = {traces[L.trace].begin, traces[L.trace].end};
+        L.row = T.startRow;
+        L.events = 0;
+        L.depth = 0;
+        L.active = true;
+    };
+
+    auto finish = [&](Lane &L, Violation v, uint32_t input) {
+        TraceResult &R = results[L.trace];
+        R.events = L.events;
+        R.violation = v;
+        if (v != NONE) {
+            R.violationEvent = L.events - 1;
+            R.input = input;
+            R.state = L.row == T.finalRow ? STATE_FINAL : T.stateOfRow[L.row];
+        }
+        refill(L);
+    };
+
+    int active = 0;
+    for (Lane &L : lanes) {
+        refill(L);
+        active += L.active;
+    }
+
+    const int32_t *next = T.next.data();
+    const int32_t *push = T.push.empty() ? nullptr : T.push.data();
+    const int32_t *colOf = T.colOf.data();
+    const uint32_t numInputs = T.colOf.size();
+    const uint32_t cols = T.cols;
+
+    while (active > 0) {
+        active = 0;
+        for (Lane &L : lanes) {
+            if (!L.active) {
+                continue;
+            }
+
+            uint32_t id;
+            if (!L.cur.next(id)) {
+                finish(L, NONE, 0);
+            } else {
+                L.events++;
+                if (L.row == T.finalRow) {
+                    finish(L, AFTER_FINAL, id);
+                } else if (id >= numInputs || colOf[id] == NO_TRANSITION) {
+                    finish(L, UNKNOWN_INPUT, id);
+                } else {
+                    size_t idx = (size_t)L.row * cols + colOf[id];
+                    int32_t n = next[idx];
+                    if (n == NO_TRANSITION) {
+                        finish(L, INVALID_TRANSITION, id);
+                    } else if (id == RETURN_ID) {
+                        if (L.depth == 0) {
+                            finish(L, RETURN_WITHOUT_CALL, id);
+                        } else {
+                            L.row = L.stack[--L.depth];
+                        }
+                    } else if (push && push[idx] != NO_TRANSITION) {
+                        if (L.depth == MAX_CALL_DEPTH) {
+                            finish(L, CALL_DEPTH_EXCEEDED, id);
+                        } else {
+                            L.stack[L.depth++] = push[idx];
+                            L.row = n;
+                        }
+                    } else {
+                        L.row = n;
+                    }
+                }
+            }
+            active += L.active;
+        }
+    }
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-j threads] [-t] [-a] <nfa.dat> <trace-file>...\n", prog);
+    fprintf(stderr, "  -j N  number of worker threads (default: all cores)\n");
+    fprintf(stderr, "  -t    trace files are text, one trace of space separated ids per line\n");
+    fprintf(stderr, "  -a    report every violating trace instead of the first 20\n");
+}
+
+int main(int argc, char **argv) {
+    unsigned threads = thread::hardware_concurrency();
+    bool text = false;
+    bool reportAll = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:ta")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 't':
+            text = true;
+            break;
+        case 'a':
+            reportAll = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        fprintf(stderr, "ERROR: Missing argument.\n");
+        usage(argv[0]);
+        return 1;
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    DenseTable T;
+    if (!loadTable(argv[optind], T)) {
+        return 1;
+    }
+
+    vector<MappedFile> files;
+    vector<Trace> traces;
+    for (int i = optind + 1; i < argc; i++) {
+        MappedFile M;
+        if (!mapFile(argv[i], M)) {
+            return 1;
+        }
+        if (text) {
+            indexText(M, traces);
+        } else if (!indexBinary(M, argv[i], traces)) {
+            return 1;
+        }
+        files.push_back(M);
+    }
+
+    vector<TraceResult> results(traces.size());
+    atomic<size_t> nextChunk{0};
+
+    auto start = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    for (unsigned i = 0; i < threads; i++) {
+        if (text) {
+            workers.emplace_back(verifyWorker<TextCursor>, cref(T), cref(traces), ref(results), ref(nextChunk));
+        } else {
+            workers.emplace_back(verifyWorker<BinaryCursor>, cref(T), cref(traces), ref(results), ref(nextChunk));
+        }
+    }
+    for (thread &w : workers) {
+        w.join();
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t events = 0;
+    size_t violations = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        const TraceResult &R = results[i];
+        events += R.events;
+        if (R.violation == NONE) {
+            continue;
+        }
+        if (reportAll || violations < 20) {
+            printf("trace %zu: event %llu, state %u, input %u: %s\n", i, (unsigned long long)R.violationEvent, R.state,
+                   R.input, violationName(R.violation));
+        }
+        violations++;
+    }
+    if (!reportAll && violations > 20) {
+        printf("... %zu more violating traces (use -a to list all)\n", violations - 20);
+    }
+
+    printf("VERIFIER: %zu traces, %zu violating, %llu events checked\n", traces.size(), violations,
+           (unsigned long long)events);
+    printf("VERIFIER: %.3f s on %u threads, %.2f M events/s, %.2f K traces/s\n", seconds, threads,
+           seconds > 0 ? events / seconds / 1e6 : 0.0, seconds > 0 ? traces.size() / seconds / 1e3 : 0.0);
+
+    for (const MappedFile &M : files) {
+        if (M.data) {
+            munmap(const_cast<uint8_t *>(M.data), M.size);
+        }
+    }
+
+    return violations ? 2 : 0;
+}